@@ -1,6 +1,10 @@
 /*****TO BUILD:  ***********************************************
 g++ -pthread [main.cpp] -o [main] -lpigpiod_if2 -lrt -std=c++20
 
+*****TO BUILD WITHOUT PIGPIO (e.g. against TLE7230Sim.h on a normal Linux box):
+g++ -pthread -DTLE7230_NO_PIGPIO [main.cpp] -o [main] -std=c++20
+
+*****Add -DTLE7230_STATS for per-operation transfer counts and latency histograms (getStats(), printStats())
 
 *
 *****TO RUN: First make sure the pigpio daemon is running******
@@ -13,6 +17,8 @@ Then:
 
 */
 
+#pragma once
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
@@ -20,113 +26,923 @@ Then:
 #include <unistd.h>
 #include <cstring>
 #include <bitset>
+#include <bit>
+#ifndef TLE7230_NO_PIGPIO
 #include <pigpiod_if2.h>
+#endif
 #include <vector>
 #include <exception>
 #include <errno.h>
 #include <algorithm>
 #include <type_traits>
 #include <numeric>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
 
 using namespace std;
 
+// GPIO (BCM numbering) the chips are wired to, TLE7230::Pins. TLE7230Static takes it as a template parameter; TLE7230 uses the defaults
+struct TLE7230Pins
+{
+    int fltn1 = 14; //FLTn of device 1
+    int fltn2 = 15; //FLTn of device 2 (daisy-chained: wired-OR of the rest of the chain)
+    int rstn  = 16;
+    int csn1  = 8;  //CE0 of the main SPI
+    int csn2  = 7;  //CE1 of the main SPI, unused when daisy-chained
+};
+
+// Which SPI a PigpioTransport talks through, TLE7230::SpiBus. The driver's chip-selects (channel 0: device 1 or the chain,
+// channel 1: device 2) go to cs[0]/cs[1]
+struct TLE7230SpiBus
+{
+    enum Kind {MAIN, AUX, BITBANG};
+    Kind kind = MAIN;
+    array<int, 2> cs = {0, 1};            //MAIN/AUX: CE number (main 0-1, aux 0-2). BITBANG: chip-select GPIO
+    int miso = -1, mosi = -1, sclk = -1;  //BITBANG only: GPIOs (pigpio bit-bangs up to 250 kHz)
+};
+
 class TLE7230
 {
+    public:
+
+        // Everything the driver needs from the SPI bus and the GPIOs. Return values follow pigpio: >= 0 ok, negative = error.
+        // PigpioTransport (pigpiod) is the default; TLE7230Sim (TLE7230Sim.h) is an in-process model of the chips.
+        class Transport
+        {
+            public:
+                static constexpr int INPUT    = 0; //gpio modes/pulls use the same values as pigpio's PI_INPUT etc.
+                static constexpr int OUTPUT   = 1;
+                static constexpr int PUD_OFF  = 0;
+                static constexpr int PUD_DOWN = 1;
+                static constexpr int PUD_UP   = 2;
+                static constexpr int EDGE_RISING  = 0; //edges for gpioCallback(), same values as pigpio
+                static constexpr int EDGE_FALLING = 1;
+                static constexpr int EDGE_EITHER  = 2;
+
+                // (gpio, new level, tick in us) runs on the transport's own thread (pigpio's callback thread), keep it short
+                using EdgeCallback = function<void(int gpio, int level, uint32_t tick)>;
+
+                virtual ~Transport() = default;
+
+                // @param channel 0 = CE0, 1 = CE1 @param mode SPI mode (0 to 3) @return handle for the other spi calls
+                virtual int spiOpen(int channel, int baud, int mode) = 0;
+                virtual int spiClose(int handle) = 0;
+                // full duplex transfer, one chip-select assertion. rx overwrites tx in Buffer
+                virtual int spiXfer(int handle, char *Buffer, int Length) = 0;
+                // frames back-to-back, chip-select released between them. Buffer holds frames*frameLength bytes, rx overwrites tx
+                // @return total bytes transferred, or the first error
+                virtual int spiXferFrames(int handle, char *Buffer, int frameLength, int frames)
+                {
+                    for(int f = 0; f < frames; ++f)
+                    {
+                        int result = spiXfer(handle, Buffer + f*frameLength, frameLength);
+                        if(result < 0) return result;
+                    }
+                    return frames*frameLength;
+                }
+                virtual int gpioSetMode(int gpio, int mode) = 0;
+                virtual int gpioSetPullUpDown(int gpio, int pud) = 0;
+                virtual int gpioRead(int gpio) = 0;
+                virtual int gpioWrite(int gpio, int level) = 0;
+                // calls fn on every matching edge of gpio, like pigpio's callback_ex
+                // @return callback id for gpioCallbackCancel(), negative if the transport can't do edge callbacks
+                virtual int gpioCallback(int gpio, int edge, EdgeCallback fn) {return -1;}
+                virtual int gpioCallbackCancel(int id) {return -1;}
+                //pigpio handle if there is one, otherwise -1
+                virtual int handle() {return -1;}
+        };
+
+#ifndef TLE7230_NO_PIGPIO
+        // Transport through the pigpio daemon (pigpiod_if2)
+        class PigpioTransport : public Transport
+        {
+            private:
+                int PI; //RTN value of pigpio_start goes here
+                bool __externalPiGpioHandle;
+                TLE7230SpiBus bus;
+                map<int, unique_ptr<EdgeCallback>> callbacks; //callback_ex id -> function, passed to pigpio as userdata
+
+                static void __edge(int pi, unsigned gpio, unsigned level, uint32_t tick, void *userdata)
+                {
+                    (*static_cast<EdgeCallback*>(userdata))(gpio, level, tick);
+                }
+
+            public:
+                //  @param PI: (optional) handle of an externally-managed piGPIO instance. Otherwise pigpio_start(...) is called
+                //             here and pigpio_stop(PI) in the destructor.  @throws runtime_error if pigpio cannot be started
+                //  @param bus: SPI to use, main SPI CE0/CE1 by default. The auxiliary SPI needs dtoverlay=spi1-Xcs, and
+                //             pigpio warns modes 1 and 3 (the TLE7230 is mode 1) may not work on it; bit-banged SPI works on any GPIOs
+                PigpioTransport(int PI = 0x42, TLE7230SpiBus bus = TLE7230SpiBus()) : PI(PI), __externalPiGpioHandle(PI != 0x42), bus(bus)
+                {
+                    if(!__externalPiGpioHandle) this->PI = pigpio_start(NULL, NULL);
+                    if(this->PI < 0) throw runtime_error(__externalPiGpioHandle ? "invalid external piGPIO handle" : "could not start pigpio");
+                }
+
+                ~PigpioTransport()
+                {
+                    for(auto& c : callbacks) callback_cancel(c.first);
+                    if(!__externalPiGpioHandle) pigpio_stop(PI);
+                }
+
+                //bit-banged: pigpio knows the bus by its chip-select GPIO, which becomes the handle
+                int spiOpen(int channel, int baud, int mode) override
+                {
+                    if(channel < 0 || channel > 1) return -1;
+                    int cs = bus.cs[channel];
+                    switch(bus.kind)
+                    {
+                        case TLE7230SpiBus::MAIN: return spi_open(PI, cs, baud, mode);
+                        case TLE7230SpiBus::AUX:  return spi_open(PI, cs, baud, mode | 1 << 8); //A bit: auxiliary SPI
+                        default:
+                            int result = bb_spi_open(PI, cs, bus.miso, bus.mosi, bus.sclk, baud, mode);
+                            return result < 0 ? result : cs;
+                    }
+                }
+                int spiClose(int handle) override
+                {
+                    return bus.kind == TLE7230SpiBus::BITBANG ? bb_spi_close(PI, handle) : spi_close(PI, handle);
+                }
+                int spiXfer(int handle, char *Buffer, int Length) override
+                {
+                    if(bus.kind == TLE7230SpiBus::BITBANG) return bb_spi_xfer(PI, handle, Buffer, Buffer, Length);
+                    return spi_xfer(PI, handle, Buffer, Buffer, Length);
+                }
+                int gpioSetMode(int gpio, int mode) override {return set_mode(PI, gpio, mode);}
+                int gpioSetPullUpDown(int gpio, int pud) override {return set_pull_up_down(PI, gpio, pud);}
+                int gpioRead(int gpio) override {return gpio_read(PI, gpio);}
+                int gpioWrite(int gpio, int level) override {return gpio_write(PI, gpio, level);}
+                int gpioCallback(int gpio, int edge, EdgeCallback fn) override
+                {
+                    auto f = make_unique<EdgeCallback>(move(fn));
+                    int id = callback_ex(PI, gpio, edge, __edge, f.get());
+                    if(id >= 0) callbacks[id] = move(f);
+                    return id;
+                }
+                int gpioCallbackCancel(int id) override
+                {
+                    int result = callback_cancel(id);
+                    callbacks.erase(id);
+                    return result;
+                }
+                int handle() override {return PI;}
+        };
+#endif
+
+        // What the driver was doing when it sent a frame: the outermost public method (or thread) on the stack.
+        // Used for the TLE7230_STATS counters and handed to anything that wants to label traffic
+        enum Operation : uint8_t
+        {
+            OP_NONE, OP_TURN_RELAY_ON, OP_TURN_RELAY_OFF, OP_TURN_RELAYS_ON, OP_TURN_RELAYS_OFF, OP_WRITE_REGISTER,
+            OP_WRITE_REGISTERS, OP_READ_REGISTER, OP_READ_REGISTERS, OP_RESET_REGISTERS, OP_UPDATE_DIAG_STATUS,
+            OP_SYNC_REGISTERS, OP_EXECUTE, OP_DIAG_POLL, OP_FAULT, OP_READ_REGISTER_SET, OP_SET_RELAY_STATE, OP_WARM_START,
+            OP_APPLY, OP_GET_RELAY_STATE, OP_GET_PROFILE, OP_COMPARE, OP_COUNT
+        };
+        static constexpr const char* OPERATION_NAMES[OP_COUNT] =
+        {
+            "none", "turnRelayOn", "turnRelayOff", "turnRelaysOn", "turnRelaysOff", "writeRegister",
+            "writeRegisters", "readRegister", "readRegisters", "resetRegisters", "updateDiagStatus",
+            "syncRegisters", "execute", "diagPoller", "faultHandler", "readRegisterSet", "setRelayState", "warmStart",
+            "apply", "getRelayState", "getProfile", "compare"
+        };
+
+        // Counters for one Operation, see getStats(). Latencies are from the start of the call (after the bus lock
+        // was taken) to its return; p50/p99 come from a histogram with 4 buckets per power of 2, so they are within 19%
+        struct OpStats
+        {
+            const char* name;
+            unsigned long long calls = 0;
+            unsigned long long transfers = 0;  //spi_xfer (or equivalent) frames
+            unsigned long long bytes = 0;
+            chrono::nanoseconds p50{0}, p99{0}, max{0};
+        };
+
+        // A channel whose diagnosis changed, found after an edge on FLTN1/FLTN2, see enableFaultInterrupts()
+        struct FaultEvent
+        {
+            int device;
+            int relay;                                 //1 to 8
+            int status;                                //RELAY_CH_OVERLOAD/OPEN/SHORT2GND, or RELAY_CH_OK when the fault cleared
+            chrono::steady_clock::time_point edge;     //when the FLTn edge callback ran
+            chrono::steady_clock::time_point detected; //when the diagnosis frame that decoded it came back
+        };
+
+        // One device's diagnosis split by category, bit relay-1 of each mask set for the relays in it; see decodeDiag()
+        struct FaultMasks
+        {
+            uint16_t word = 0xFFFF; //the diagnosis word decoded
+            uint8_t ok = 0xFF;
+            uint8_t overload = 0;   //RELAY_CH_OVERLOAD
+            uint8_t open = 0;       //RELAY_CH_OPEN
+            uint8_t short2gnd = 0;  //RELAY_CH_SHORT2GND
+            uint8_t changed = 0;    //relays whose status differs from the previous word
+            uint8_t faults() const {return ~ok;}
+        };
+
+        using Pins = TLE7230Pins;
+        using SpiBus = TLE7230SpiBus;
+
+        // How the constructor takes over the chips. COLD: RSTn is set up as an output, the caller resets and configures.
+        // WARM: attach to chips that are already running (e.g. after a process restart) without disturbing them
+        enum Start {COLD, WARM};
+
+        // Frame layout, shared with TLE7230Static: bytes in one frame, and where device's 2 bytes sit in it.
+        // Daisy-chained, device 1 (MOSI-receiving) is shifted out last, so its bytes are at the end
+        static constexpr int frameLength(bool daisyChain, int devices) {return daisyChain ? 2*devices : 2;}
+        static constexpr int frameOffset(bool daisyChain, int devices, int device) {return daisyChain ? (devices - device)*2 : 0;}
+
+        // One diagnosis word the driver received, see enableDiagHistory(). 16 bytes, the on-disk format too
+        struct DiagRecord
+        {
+            int64_t time;      //when the frame came back: system_clock ns, as system_clock at enableDiagHistory() + steady_clock since
+            uint16_t diag;     //diagnosis word, 2 bits per channel (RELAY_CH_x), relay 1 in bits 1:0
+            uint8_t device;
+            uint8_t command;   //command byte the device got on the frame before, which this word answers
+            uint8_t op;        //Operation that sent the frame
+            uint8_t reserved;
+            uint16_t check;    //low 16 bits of the record's sequence number, written last: a torn record doesn't match
+        };
+        static_assert(sizeof(DiagRecord) == 16, "DiagRecord is an on-disk format");
+
+        // Start of a diagnosis history file (or in-memory ring), followed by capacity DiagRecords
+        struct DiagLogHeader
+        {
+            char magic[8];                 //DIAG_LOG_MAGIC
+            uint32_t version;
+            uint32_t recordSize;
+            uint64_t capacity;
+            int64_t created;               //system_clock ns when the log was started
+            atomic<uint64_t> written;      //records ever written; record n lives at n % capacity
+        };
+        static_assert(atomic<uint64_t>::is_always_lock_free, "DiagLogHeader is shared through a file mapping");
+        static constexpr char DIAG_LOG_MAGIC[8] = {'T', 'L', 'E', '7', '2', '3', '0', 'D'};
+        static constexpr uint32_t DIAG_LOG_VERSION = 1;
+
+        // On/off state of every relay: state[device-1][relay-1], one bitset (= CTL value) per device
+        using RelayState = vector<bitset<8>>;
+
+        // Register contents of every device, from readAllRegisters()/readRegisterSet()
+        struct RegisterSet
+        {
+            vector<array<unsigned char, 8>> regs; //regs[device-1][addr], addr MAP to CTL (0 = not read)
+            vector<bitset<16>> diag;              //diagnosis word of each device, shifted out after its last read
+            bitset<8> read;                       //addresses that were read
+            chrono::steady_clock::time_point time;
+
+            unsigned char get(int device, char addr) const {return regs.at(device-1).at(addr);}
+        };
+
     private:
+        template <bool, int, Pins> friend class TLE7230Static; //uses the command bytes and SPI mode below
+
+        unique_ptr<Transport> ownedTransport; //set when the constructor made its own PigpioTransport
+        Transport* io;
 
         // RTN value of spi_open or bb_spi_open [bit-banged] goes here
         // initialize to {-1,-1} as 0 is a valid value
-        pair<int, int> spiHandles;
-        static constexpr int BUFFERLEN = 4;
-        char* buffer;
-        int PI; //needed for pigpio. RTN value of pigpio_start goes here
-        bool daisyChain; //if false, use chipselect0 vs. chipselect1 and tx 16 bits per frame. if true only one CSn and 32b/frame
-
-        static constexpr int FLTN1   = 14; //GPIO14 is FLTn (not fault on IC1)
-        static constexpr int FLTN2   = 15; //GPIO15
-        static constexpr int RSTN    = 16; //GPIO16
+        pair<int, int> spiHandles = pair<int, int>(-1, -1);
+        int baud = 0;           //SCLK the channel(s) were opened with, see setBaud()
+        char* buffer = nullptr; //one frame: 2 bytes per chip on the chip-select
+        bool daisyChain; //if false, use chipselect0 vs. chipselect1 and tx 16 bits per frame. if true only one CSn and 16*devices b/frame
+        int devices;     //number of TLE7230s. Always 2 with chip-selects, 1..N when daisy-chained
+
+        Pins pins;
+        const int FLTN1   = pins.fltn1; //GPIO14 by default is FLTn (not fault on IC1)
+        const int FLTN2   = pins.fltn2; //GPIO15
+        const int RSTN    = pins.rstn;  //GPIO16
         static constexpr char DIAGNOSIS_ONLY  = 0b00000000; //spi commands. e.g. READ_REGISTER | MAP reads MAP reg
         static constexpr char READ_REGISTER   = 0b01000000; //spi commands. e.g. READ_REGISTER | MAP reads MAP reg
         static constexpr char RESET_DEVICE    = 0b10000000; //spi commands. e.g. READ_REGISTER | MAP reads MAP reg
         static constexpr char WRITE_REGISTER  = 0b11000000; //spi commands. e.g. READ_REGISTER | MAP reads MAP reg
+        static constexpr char COMMAND_MASK    = 0b11000000; //command bits of the first byte of a frame
+        static constexpr char ADDRESS_MASK    = 0b00111111; //address bits of the first byte of a frame
         static constexpr int MOSI = 10;
         static constexpr int MISO = 9;
         static constexpr int SCLK = 11;
-        static constexpr int CSN1 = 8;
-        static constexpr int CSN2 = 7;
+        const int CSN1 = pins.csn1;
+        const int CSN2 = pins.csn2;
 
-        bool __externalPiGpioHandle;
-        
         //SPI_MODE_1 (0,1)   CPOL = 0, CPHA = 1, Clock idle low, data is clocked in on falling edge, output data (change) on rising edge
         static constexpr int SPI_MODE = 1;
 
-        //holds last-received diagnosis status bits received.
+        //holds last-received diagnosis status bits received, diagStatus[device-1]
         //    0b8877_6655_4433_2211 where #s are CHx
         //    0b11 = normal, 0b10 = overcurrent/SCB, 0b01 = open load, 0b00 = short to ground
-        pair<bitset<16>, bitset<16>> diagStatus = pair<bitset<16>, bitset<16>>(bitset<16>(0xFFFF), bitset<16>(0xFFFF));
-        
-        //public version uses copy constructor
-        constexpr bitset<16> __diagStatus(int device)
-        {
-            return device == 2 ? diagStatus.second : diagStatus.first;
-        }
-
-        // (Daisy-Chain) Result of the read will be in buffer
-        // @warning daisy chain only @throws runtime_error
-        // @param addr1 address of register in MOSI-receiving device @param addr2 address of register in MISO-transmitting device
-        int __readRegisters(char addr1, char addr2)
-        {
-            if(addr1 < 1 || addr1 > 8) throw runtime_error("invalid address1; __readRegisters\n");
-            if(addr2 < 1 || addr2 > 8) throw runtime_error("invalid address2; __readRegisters\n");
-            if(!daisyChain)            throw runtime_error("error: __readRegisters() daisy chain method used w/o daisy chain enabled\n");
-            //buffer tx/rx big endian:  [3:LSB1][2:MSB1][1:LSB2][0:MSB2]---->
-            buffer[0] = READ_REGISTER | addr2;
-            buffer[2] = READ_REGISTER | addr1;
-            int result = SpiWriteAndRead(spiChannel(1), buffer, 4);
-                if(result < 0) return result;
-            diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-            diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-            //printf("diagnosis out: %#x %#x %#x %#x\n", buffer[0], buffer[1], buffer[2], buffer[3]);
-            buffer[0] = DIAGNOSIS_ONLY;
-            //buffer[1] = DIAGNOSIS_ONLY; //don't care
-            return SpiWriteAndRead(spiChannel(1), buffer, 4); //read result returned on next SPI frame, send diagnosis cmd
+        vector<bitset<16>> diagStatus;
+
+        //command byte each device got in the previous frame, lastCmd[device-1]. The chip answers a command on the NEXT frame,
+        //so this decides whether what comes back is a diagnosis word or the result of a read
+        vector<char> lastCmd;
+        //lastCmd after a warm start: the first word shifted out answers the previous process' last command, so it's dropped.
+        //A write to address 63, never sent
+        static constexpr char ANSWER_UNKNOWN = (char)0xFF;
+        //held by every public method that touches the bus or the state it fills in (buffer, diagStatus, caches),
+        //so the diagnosis poller and the caller's thread(s) don't interleave frames
+        recursive_mutex busLock;
+
+        //lock-free copy of diagStatus for getDiagSnapshot(): a seqlock, snapSequence is odd while __publishDiag() writes it
+        atomic<uint64_t> snapSequence{0};
+        unique_ptr<atomic<uint16_t>[]> snapDiag;
+        atomic<int64_t> snapTime{0};                        //steady_clock ticks of the newest diagnosis word
+        vector<chrono::steady_clock::time_point> diagTime;  //when each device last shifted out a diagnosis word
+
+        //diagnosis history ring, see enableDiagHistory(): one mapping, header then records. Written with busLock held
+        DiagLogHeader* diagLog = nullptr;
+        DiagRecord* diagRecords = nullptr;
+        size_t diagLogBytes = 0;
+        chrono::nanoseconds diagLogOffset{0}; //system_clock - steady_clock when history was enabled
+
+        //background diagnosis poller, see startDiagPoller()
+        thread poller;
+        mutex pollerLock;
+        condition_variable pollerWake;
+        bool pollerRun = false;
+        chrono::steady_clock::duration pollPeriod{};
+        atomic<unsigned long long> pollFrames{0};  //DIAGNOSIS_ONLY frames the poller had to send
+        atomic<unsigned long long> pollSkips{0};   //polls answered by diagnosis that other commands had already shifted out
+
+        //FLTn interrupts, see enableFaultInterrupts(). The edge callback only flags the pin; faultThread does the SPI
+        thread faultThread;
+        mutex faultLock;
+        condition_variable faultWake;
+        bool faultRun = false;
+        unsigned faultPending = 0;                       //bit 0: FLTN1 edge, bit 1: FLTN2 edge
+        chrono::steady_clock::time_point faultEdge;      //first edge not handled yet
+        array<int, 2> faultCallbacks = {-1, -1};         //transport callback ids for FLTN1/FLTN2
+        vector<uint16_t> faultReported;                  //diagnosis word last turned into events, per device
+        mutex subscriberLock;
+        vector<pair<int, function<void(const FaultEvent&)>>> faultSubscribers;
+        int nextSubscriber = 0;
+
+        Operation currentOp = OP_NONE; //outermost operation in progress, guarded by busLock
+        int opDepth = 0;
+
+#ifdef TLE7230_STATS
+        static constexpr int HISTOGRAM_BUCKETS = 64*4;
+        struct OpCounters
+        {
+            atomic<unsigned long long> calls{0}, transfers{0}, bytes{0}, maxNs{0};
+            array<atomic<unsigned long long>, HISTOGRAM_BUCKETS> histogram{};
+        };
+        array<OpCounters, OP_COUNT> stats;
+
+        //log2 of ns with 2 more bits of mantissa: bucket b covers [__bucketFloor(b), __bucketFloor(b+1))
+        static int __bucket(unsigned long long ns)
+        {
+            if(ns < 4) return ns;
+            int log = 63 - __builtin_clzll(ns);
+            return log*4 + (ns >> (log-2) & 3);
+        }
+        static unsigned long long __bucketFloor(int b) {return b < 4 ? b : (4ull | (b & 3)) << (b/4 - 2);}
+#endif
+
+        //marks the outermost public call in progress; with TLE7230_STATS also times it
+        struct __OpScope
+        {
+            TLE7230* t;
+            bool outer;
+#ifdef TLE7230_STATS
+            chrono::steady_clock::time_point start;
+#endif
+            __OpScope(TLE7230* t, Operation op) : t(t), outer(t->opDepth++ == 0)
+            {
+                if(!outer) return;
+                t->currentOp = op;
+#ifdef TLE7230_STATS
+                start = chrono::steady_clock::now();
+#endif
+            }
+            ~__OpScope()
+            {
+                --t->opDepth;
+                if(!outer) return;
+#ifdef TLE7230_STATS
+                unsigned long long ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                OpCounters& c = t->stats[t->currentOp];
+                c.calls.fetch_add(1, memory_order_relaxed);
+                c.histogram[__bucket(ns)].fetch_add(1, memory_order_relaxed);
+                if(ns > c.maxNs.load(memory_order_relaxed)) c.maxNs.store(ns, memory_order_relaxed);
+#endif
+                t->currentOp = OP_NONE;
+            }
+        };
+
+        vector<char> txCmd;     //scratch for __transferFrames(), command bytes as sent [frame*devices + device-1]
+        vector<char> batchFrames; //scratch for execute(), every frame of one chip-select back to back
+
+        //write-through shadow copy of the writable registers (MAP, BOL, OVL, OVT, SLE, CTL), regCache[device-1][addr]
+        //    regCacheValid[device-1][addr] is set by a successful write or read, cleared by reset/RSTN or invalidateRegisterCache()
+        //    regCacheTime is when the entry was last confirmed, entries older than regCacheLifetime are re-read from the device
+        vector<array<char, 8>> regCache;
+        vector<bitset<8>> regCacheValid;
+        vector<array<chrono::steady_clock::time_point, 8>> regCacheTime;
+        chrono::steady_clock::duration regCacheLifetime = chrono::steady_clock::duration::zero(); //zero = never expires
+
+        //only the writable registers are shadowed; STA changes on its own
+        static constexpr bool __cacheable(char addr) {return addr >= MAP && addr <= CTL && addr != STA;}
+
+        void __cacheStore(int device, char addr, char data)
+        {
+            if(!__cacheable(addr)) return;
+            regCache[device-1][addr] = data;
+            regCacheValid[device-1].set(addr);
+            regCacheTime[device-1][addr] = chrono::steady_clock::now();
+        }
+
+        bool __cacheFresh(int device, char addr)
+        {
+            if(!regCacheValid[device-1][addr]) return false;
+            return regCacheLifetime == chrono::steady_clock::duration::zero()
+                || chrono::steady_clock::now() - regCacheTime[device-1][addr] < regCacheLifetime;
+        }
+
+        // Shadow value of a writable register. Only talks to the device if the cached copy is missing or stale
+        // @return register contents (0 to 255) or negative pigpio error @throws runtime_error
+        int __shadowRegister(int device, char addr)
+        {
+            __checkDevice(device, "__shadowRegister()");
+            if(__cacheFresh(device, addr)) return (unsigned char)regCache[device-1][addr];
+            int result = __readRegister(device, addr);
+            if(result < 0) return result;
+            return (unsigned char)regCache[device-1][addr]; //filled in by the read
+        }
+
+        void __checkDevice(int device, const char* method)
+        {
+            if(device < 1 || device > devices) throw runtime_error(string("invalid device; ") + method);
+        }
+
+        static void __checkAddress(char addr, const char* method)
+        {
+            if(addr < 1 || addr > 8) throw runtime_error(string("invalid address; ") + method);
+        }
+
+        //bytes per frame on one chip-select: 16 bits for every chip on it
+        int __frameLength() {return frameLength(daisyChain, devices);}
+
+        //offset of a device's 16 bits in buffer. Daisy-chained, the first word shifted in travels through to the last chip:
+        //    buffer tx/rx:  [0:MSBn][1:LSBn] ... [2n-4:MSB2][2n-3:LSB2][2n-2:MSB1][2n-1:LSB1]
+        int __offset(int device) {return frameOffset(daisyChain, devices, device);}
+
+        //devices sharing the chip-select of device, i.e. the ones a frame to device also reaches
+        int __firstOnFrame(int device) {return daisyChain ? 1 : device;}
+        int __lastOnFrame(int device) {return daisyChain ? devices : device;}
+
+        //starts a new frame: every chip on the chip-select gets DIAGNOSIS_ONLY unless __put() says otherwise
+        void __clearFrame() {memset(buffer, DIAGNOSIS_ONLY, __frameLength());}
+
+        void __put(int device, char cmd, char data = 0)
+        {
+            buffer[__offset(device)] = cmd;
+            buffer[__offset(device)+1] = data;
+        }
+
+        //what a device shifted out, given what it was told on the frame before
+        void __response(int device, uint16_t word)
+        {
+            char cmd = lastCmd[device-1];
+            if(cmd == ANSWER_UNKNOWN) return;
+            if((char)(cmd & COMMAND_MASK) == READ_REGISTER) __cacheStore(device, cmd & ADDRESS_MASK, word & 0xFF);
+            else
+            {
+                diagStatus[device-1] = bitset<16>(word);
+                diagTime[device-1] = chrono::steady_clock::now();
+                if(diagLog) __logDiag(device, cmd, word);
+            }
+        }
+
+        //appends to the history ring: plain stores into the mapping, then one release store to publish
+        void __logDiag(int device, char cmd, uint16_t word)
+        {
+            uint64_t n = diagLog->written.load(memory_order_relaxed);
+            DiagRecord& r = diagRecords[n % diagLog->capacity];
+            r.check = ~(uint16_t)n; //invalid while it's being rewritten
+            atomic_signal_fence(memory_order_release);
+            r.time = (diagTime[device-1].time_since_epoch() + diagLogOffset) / chrono::nanoseconds(1);
+            r.diag = word;
+            r.device = device;
+            r.command = cmd;
+            r.op = currentOp;
+            r.reserved = 0;
+            atomic_signal_fence(memory_order_release);
+            r.check = (uint16_t)n;
+            diagLog->written.store(n + 1, memory_order_release);
+        }
+
+        //records that survived in a ring, oldest first; skips any that are half-written
+        static vector<DiagRecord> __readDiagLog(const DiagLogHeader* log, const DiagRecord* records)
+        {
+            vector<DiagRecord> out;
+            uint64_t written = log->written.load(memory_order_acquire);
+            uint64_t first = written > log->capacity ? written - log->capacity : 0;
+            out.reserve(written - first);
+            for(uint64_t n = first; n < written; ++n)
+            {
+                DiagRecord r = records[n % log->capacity];
+                if(r.check == (uint16_t)n) out.push_back(r);
+            }
+            return out;
+        }
+
+        static bool __validDiagLog(const DiagLogHeader* log, size_t bytes)
+        {
+            return bytes >= sizeof(DiagLogHeader) && !memcmp(log->magic, DIAG_LOG_MAGIC, 8) && log->version == DIAG_LOG_VERSION
+                && log->recordSize == sizeof(DiagRecord) && log->capacity > 0
+                && bytes == sizeof(DiagLogHeader) + log->capacity*sizeof(DiagRecord);
+        }
+
+        //consistent read of the seqlock snapshot: store(device-1, word) for every device, may run more than once
+        template <typename Store> uint64_t __readSnapshot(Store store, chrono::steady_clock::time_point& time)
+        {
+            uint64_t before, after;
+            do
+            {
+                before = snapSequence.load(memory_order_acquire);
+                for(int d = 0; d < devices; ++d) store(d, snapDiag[d].load(memory_order_relaxed));
+                time = chrono::steady_clock::time_point(chrono::steady_clock::duration(snapTime.load(memory_order_relaxed)));
+                atomic_thread_fence(memory_order_acquire);
+                after = snapSequence.load(memory_order_relaxed);
+            } while(before != after || (before & 1));
+            return before / 2;
+        }
+
+        //per 16-bit lane: bits 0, 2, .. 14 packed into bits 0 to 7, the rest of the lane cleared
+        static constexpr uint64_t __packEven(uint64_t x)
+        {
+            x &= 0x5555555555555555;
+            x = (x | x >> 1) & 0x3333333333333333;
+            x = (x | x >> 2) & 0x0F0F0F0F0F0F0F0F;
+            x = (x | x >> 4) & 0x00FF00FF00FF00FF;
+            return x;
         }
 
-        // (Daisy-Chain) Result of the read will be in buffer
-        // @warning daisy chain only @throws runtime_error
-        // @param addr address of register
-        int __readRegisters(char addr)
+        //n (1 to 4) diagnosis words, one per 16-bit lane: low/high bit of every channel packed into a byte, then
+        //the 4 status codes are and/or of the two bytes. A channel changed if either of its bits differs
+        static constexpr void __decodeDiag(uint64_t words, uint64_t previous, FaultMasks* out, int n)
         {
-            return __readRegisters(addr, addr);
+            uint64_t lo = __packEven(words), hi = __packEven(words >> 1), diff = words ^ previous;
+            uint64_t changed = __packEven(diff | diff >> 1);
+            uint64_t ok = hi & lo, overload = hi & ~lo, open = ~hi & lo, short2gnd = ~(hi | lo);
+            for(int k = 0; k < n; ++k)
+            {
+                int shift = 16*k;
+                out[k] = FaultMasks{uint16_t(words >> shift), uint8_t(ok >> shift), uint8_t(overload >> shift),
+                                    uint8_t(open >> shift), uint8_t(short2gnd >> shift), uint8_t(changed >> shift)};
+            }
         }
 
-        // (Daisy-Chain) Result of the read will be in buffer
-        // @warning daisy chain only @throws runtime_error
-        // @param device 1 (MOSI-receiving device) or 2 (MISO-transmitting device) @param addr address to read
+        //count words, word(i) and previous(i), decoded 4 at a time into out[0 to count-1]
+        template <typename Word, typename Previous> static void __decodeRun(int count, FaultMasks* out, Word word, Previous previous)
+        {
+            for(int i = 0; i < count; i += 4)
+            {
+                int n = min(4, count - i);
+                uint64_t now = 0, before = 0;
+                for(int k = 0; k < n; ++k)
+                {
+                    now |= uint64_t(word(i+k)) << 16*k;
+                    before |= uint64_t(previous(i+k)) << 16*k;
+                }
+                __decodeDiag(now, before, out + i, n);
+            }
+        }
+
+        //decodes masks[d].word in place, changed against previous (nullptr: 0)
+        static void __decodeMasks(vector<FaultMasks>& masks, const vector<bitset<16>>* previous)
+        {
+            __decodeRun(masks.size(), masks.data(), [&](int i){return masks[i].word;},
+                        [&](int i){return previous ? uint16_t((*previous)[i].to_ulong()) : masks[i].word;});
+        }
+
+        //copies diagStatus into the seqlock snapshot. Only called with busLock held, so there is one writer at a time
+        void __publishDiag()
+        {
+            uint64_t seq = snapSequence.load(memory_order_relaxed);
+            snapSequence.store(seq + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            chrono::steady_clock::time_point newest{};
+            for(int d = 0; d < devices; ++d)
+            {
+                snapDiag[d].store(diagStatus[d].to_ulong(), memory_order_relaxed);
+                newest = max(newest, diagTime[d]);
+            }
+            snapTime.store(newest.time_since_epoch().count(), memory_order_relaxed);
+            snapSequence.store(seq + 2, memory_order_release);
+        }
+
+        //poller thread: every pollPeriod, sends DIAGNOSIS_ONLY to each chip-select whose devices haven't reported within the period
+        void __pollLoop()
+        {
+            unique_lock<mutex> wait(pollerLock);
+            auto next = chrono::steady_clock::now();
+            while(pollerRun)
+            {
+                next += pollPeriod;
+                if(pollerWake.wait_until(wait, next, [this]{return !pollerRun;})) break;
+                wait.unlock();
+                {
+                    lock_guard<recursive_mutex> lock(busLock);
+                    __OpScope scope(this, OP_DIAG_POLL);
+                    auto stale = chrono::steady_clock::now() - pollPeriod;
+                    for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+                    {
+                        bool fresh = true;
+                        for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) fresh &= diagTime[d-1] > stale;
+                        if(fresh) {++pollSkips; continue;}
+                        __clearFrame();
+                        if(__transfer(device) >= 0) ++pollFrames;
+                    }
+                }
+                wait.lock();
+                auto now = chrono::steady_clock::now();
+                if(next < now - pollPeriod) next = now; //fell behind (e.g. long batch), don't burst to catch up
+            }
+        }
+
+        //runs on the transport's callback thread: just note the pin and wake faultThread
+        void __faultEdge(int gpio)
+        {
+            {
+                lock_guard<mutex> wait(faultLock);
+                if(!faultPending) faultEdge = chrono::steady_clock::now();
+                faultPending |= gpio == FLTN1 ? 1 : 2;
+            }
+            faultWake.notify_one();
+        }
+
+        //fault thread: fetch diagnosis from the device(s) behind the pin that moved and turn changed channels into events
+        void __faultLoop()
+        {
+            unique_lock<mutex> wait(faultLock);
+            while(true)
+            {
+                faultWake.wait(wait, [this]{return faultPending || !faultRun;});
+                if(!faultRun) break;
+                unsigned pins = faultPending;
+                auto edge = faultEdge;
+                faultPending = 0;
+                wait.unlock();
+
+                vector<FaultEvent> events;
+                {
+                    lock_guard<recursive_mutex> lock(busLock);
+                    __OpScope scope(this, OP_FAULT);
+                    //FLTN1 is device 1, FLTN2 device 2 (or the rest of the chain, one frame gets them all anyway)
+                    for(int device : {1, 2})
+                    {
+                        if(!(pins & device) || device > devices) continue;
+                        if(device == 2 && daisyChain && (pins & 1)) continue; //same frame as device 1
+                        __clearFrame();
+                        if(__transfer(device) < 0) continue;
+                        auto detected = chrono::steady_clock::now();
+                        for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                        {
+                            uint16_t now = diagStatus[d-1].to_ulong();
+                            FaultMasks m = decodeDiag(now, faultReported[d-1]);
+                            for(unsigned changed = m.changed; changed; changed &= changed - 1)
+                            {
+                                int r = countr_zero(changed) + 1;
+                                events.push_back(FaultEvent{d, r, now >> (r*2-2) & 0b11, edge, detected});
+                            }
+                            faultReported[d-1] = now;
+                        }
+                    }
+                }
+                if(!events.empty())
+                {
+                    vector<pair<int, function<void(const FaultEvent&)>>> subscribers;
+                    {
+                        lock_guard<mutex> subs(subscriberLock);
+                        subscribers = faultSubscribers;
+                    }
+                    for(const FaultEvent& e : events) for(auto& s : subscribers) s.second(e);
+                }
+                wait.lock();
+            }
+        }
+
+        // Sends count frames back to back on the chip-select of device and files what came back: diagnosis words go to
+        // diagStatus, answers to an earlier read go to the register cache. The received frames stay in frames for the caller.
+        // @return pigpio's SPI R/W return value
+        int __transferFrames(int device, char* frames, int count)
+        {
+            int len = __frameLength();
+            if((int)txCmd.size() < count*devices) txCmd.resize(count*devices);
+            for(int f = 0; f < count; ++f)
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) txCmd[f*devices + d-1] = frames[f*len + __offset(d)];
+            int result = count == 1 ? SpiWriteAndRead(spiChannel(device), frames, len) : SpiWriteAndReadFrames(spiChannel(device), frames, len, count);
+            if(result < 0) return result;
+            for(int f = 0; f < count; ++f)
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                {
+                    __response(d, __frameWord(frames + f*len, __offset(d)));
+                    lastCmd[d-1] = txCmd[f*devices + d-1];
+                }
+            __publishDiag();
+            return result;
+        }
+
+        // Sends the frame in buffer on the chip-select of device, see __transferFrames()
+        int __transfer(int device) {return __transferFrames(device, buffer, 1);}
+
+        // Result of the read will be in buffer at __offset(device)+1
+        // Daisy-chained, every device in the chain reads addr: the frames cost the same and it refreshes their cache too
+        // @param device 1 to devices @param addr address to read @throws runtime_error
         int __readRegister(int device, char addr)
         {
             //cout<<"__readRegister()\n";
-            if(addr < 1 || addr > 8) throw runtime_error("invalid address; __readRegister");
-            if(daisyChain)
-                throw runtime_error("error, __readRegister() non-daisy chain method used w/ daisy chain enabled; use __readRegisters()");
-            buffer[0] = READ_REGISTER | addr;
-            //buffer[1] = READ_REGISTER | addr; //don't care
-            //printf("SPI_OUT to device %d: %#x %#x\n", device, buffer[0], buffer[1]);
-            int result = SpiWriteAndRead(spiChannel(device), buffer, 2);
+            __checkDevice(device, "__readRegister()");
+            __checkAddress(addr, "__readRegister()");
+            __clearFrame();
+            for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) __put(d, READ_REGISTER | addr);
+            int result = __transfer(device);
             //cout<<"SpiWriteAndRead() rtn: "<<result<<'\n';
             if(result < 0) return result;
-            (device == 1 ? diagStatus.first : diagStatus.second) = bitset<16>((buffer[0] << 8) | buffer[1]);
-            //printf("diagnostics shifted out during read command: %#x %#x\n", buffer[0], buffer[1]);
             //cout<<"sending diagnosis command to get result of read\n";
-            buffer[0] = DIAGNOSIS_ONLY;
-            //buffer[1] = DIAGNOSIS_ONLY; //don't care
-            //printf("SPI_OUT to device %d: %#x %#x\n", device, buffer[0], buffer[1]);
-            result = SpiWriteAndRead(spiChannel(device), buffer, 2);
-            //cout<<"SpiWriteAndRead() rtn: "<<result<<'\n';
-            //printf("read result shifted out: %#x %#x\n", buffer[0], buffer[1]);
+            __clearFrame();
+            return __transfer(device); //read result returned on next SPI frame, send diagnosis cmd
+        }
+
+        // One register per device, out[d-1] = contents of addrs[d-1] of device d (addrs[d-1] == 0: not read, out[d-1] = 0)
+        // Daisy-chained this is always 2 frames, otherwise 2 frames per device read
+        // @throws runtime_error
+        int __readRegisters(const vector<char>& addrs, vector<char>& out)
+        {
+            if((int)addrs.size() != devices) throw runtime_error("need one address per device; __readRegisters()");
+            for(char a : addrs) if(a) __checkAddress(a, "__readRegisters()");
+            out.assign(devices, 0);
+            int result = 0;
+            for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+            {
+                bool any = false;
+                __clearFrame();
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                    if(addrs[d-1]) {__put(d, READ_REGISTER | addrs[d-1]); any = true;}
+                if(!any) continue;
+                result = __transfer(device);
+                if(result < 0) return result;
+                __clearFrame();
+                result = __transfer(device); //read result returned on next SPI frame, send diagnosis cmd
+                if(result < 0) return result;
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                    if(addrs[d-1]) out[d-1] = buffer[__offset(d)+1];
+            }
+            return result;
+        }
+
+        // Reads addrs, in order, from every device on the chip-select of device as one pipelined run: frame k carries read k
+        // and clocks out the answer to read k-1, the last frame is DIAGNOSIS_ONLY. K reads cost K+1 frames instead of 2K.
+        // Answers go to out.regs (and the register cache), the final diagnosis words to out.diag
+        // @return pigpio's SPI R/W return value
+        int __readRegisterSet(int device, const vector<char>& addrs, RegisterSet& out)
+        {
+            int len = __frameLength(), count = addrs.size() + 1;
+            batchFrames.assign(count*len, DIAGNOSIS_ONLY);
+            for(size_t k = 0; k < addrs.size(); ++k)
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) batchFrames[k*len + __offset(d)] = READ_REGISTER | addrs[k];
+            int result = __transferFrames(device, batchFrames.data(), count);
+            if(result < 0) return result;
+            for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+            {
+                for(size_t k = 0; k < addrs.size(); ++k) out.regs[d-1][addrs[k]] = batchFrames[(k+1)*len + __offset(d) + 1];
+                out.diag[d-1] = diagStatus[d-1];
+            }
             return result;
         }
 
+        // Shadow CTL of every device into out. Devices whose shadow is missing or stale are read first, one pipelined
+        // run per chip-select that has any (2 frames)
+        // @return pigpio's SPI R/W return value of the reads (0 if none were needed)
+        int __relayState(RelayState& out)
+        {
+            int result = 0;
+            for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+            {
+                bool stale = false;
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) stale |= !__cacheFresh(d, CTL);
+                if(!stale) continue;
+                RegisterSet read;
+                read.regs.assign(devices, {});
+                read.diag.assign(devices, bitset<16>(0xFFFF));
+                result = __readRegisterSet(device, {CTL}, read);
+                if(result < 0) return result;
+            }
+            out.resize(devices);
+            for(int d = 1; d <= devices; ++d) out[d-1] = (unsigned char)regCache[d-1][CTL];
+            return result;
+        }
+
+        // Writes CTL of every device at once: one frame daisy-chained (every chip latches on the same CSn edge), otherwise
+        // back-to-back frames. Devices whose shadow already matches are left out (daisy-chained: all or nothing)
+        // @return pigpio's SPI R/W return value, or 0 if nothing needed writing
+        int __writeRelayState(const RelayState& state)
+        {
+            vector<bool> differs(devices);
+            bool any = false;
+            for(int d = 1; d <= devices; ++d)
+                any |= differs[d-1] = !__cacheFresh(d, CTL) || (unsigned char)regCache[d-1][CTL] != state[d-1].to_ulong();
+            Batch batch;
+            for(int d = 1; d <= devices; ++d)
+                if(differs[d-1] || (daisyChain && any)) batch.writeRegister(d, CTL, state[d-1].to_ulong());
+            int result = 0;
+            for(const BatchResult& r : execute(batch)) if(r.status < 0 || result >= 0) result = r.status;
+            return result;
+        }
+
+        void __checkRelayState(const RelayState& state, const char* method)
+        {
+            if((int)state.size() != devices) throw runtime_error(string("need one bitset per device; ") + method);
+        }
+
+        //opens the spi channel(s) and sets up RSTn/FLTnX, shared by the constructors. A warm start leaves RSTn as it is
+        void __open(int baud, Start start)
+        {
+            if(devices < 1 || (!daisyChain && devices != 2))
+                throw runtime_error("invalid number of devices: 2 with chip-selects, 1 or more daisy-chained");
+            __openSpi(baud);
+            //set RSTn to output
+            if(start == COLD) io->gpioSetMode(RSTN, Transport::OUTPUT);
+            //set FLTnX to inputs
+            io->gpioSetMode(FLTN1, Transport::INPUT);
+            io->gpioSetMode(FLTN2, Transport::INPUT);
+            //io->gpioSetPullUpDown(RSTN, Transport::PUD_UP);
+            io->gpioSetPullUpDown(FLTN1, Transport::PUD_UP);
+            io->gpioSetPullUpDown(FLTN2, Transport::PUD_UP);
+            if(start == COLD) io->gpioSetPullUpDown(RSTN, Transport::PUD_DOWN);
+            diagStatus.assign(devices, bitset<16>(0xFFFF));
+            diagTime.assign(devices, chrono::steady_clock::time_point{});
+            faultReported.assign(devices, 0xFFFF);
+            snapDiag = make_unique<atomic<uint16_t>[]>(devices);
+            for(int d = 0; d < devices; ++d) snapDiag[d].store(0xFFFF);
+            lastCmd.assign(devices, start == WARM ? ANSWER_UNKNOWN : DIAGNOSIS_ONLY);
+            txCmd.assign(devices, DIAGNOSIS_ONLY);
+            regCache.assign(devices, array<char, 8>{});
+            regCacheValid.assign(devices, bitset<8>());
+            regCacheTime.assign(devices, array<chrono::steady_clock::time_point, 8>{});
+            buffer = new char[__frameLength()];
+            if(start == WARM) __warmStart();
+        }
+
+        //opens the spi channel(s) at baud into spiHandles
+        void __openSpi(int baud)
+        {
+            spiHandles = pair<int, int>(io->spiOpen(spiChannel(1), baud, SPI_MODE), daisyChain ? -1 : io->spiOpen(spiChannel(2), baud, SPI_MODE));
+            if(spiHandles.second < 0 && !daisyChain) throw runtime_error("could not open SPI port 2" + string(spiHandles.first < 0 ? " or 1" : ""));
+            if(spiHandles.first < 0) throw runtime_error("could not open SPI port 1");
+            this->baud = baud;
+        }
+
+        //adopts what the chips hold: every register of every device in one pipelined sweep per chip-select (fills the
+        //register cache), then a diagnosis frame. Nothing is written. On failure the spi channel(s) are closed again
+        void __warmStart()
+        {
+            __OpScope scope(this, OP_WARM_START);
+            RegisterSet found;
+            found.regs.assign(devices, {});
+            found.diag.assign(devices, bitset<16>(0xFFFF));
+            int result = 0;
+            for(int d = 1; d <= devices && result >= 0; d = __lastOnFrame(d) + 1)
+                result = __readRegisterSet(d, {MAP, BOL, OVL, OVT, SLE, STA, CTL}, found);
+            if(result >= 0) result = updateDiagStatus();
+            if(result >= 0) return;
+            io->spiClose(spiHandles.first);
+            if(!daisyChain) io->spiClose(spiHandles.second);
+            delete[] buffer;
+            throw runtime_error("spi communication failed; warm start");
+        }
+
+        //reads the addresses of addrs that any device has no fresh cached copy of (pipelined, every device)
+        //@return pigpio's SPI R/W return value, 0 if nothing needed reading
+        int __fillCache(bitset<8> addrs)
+        {
+            vector<char> stale;
+            for(char addr = MAP; addr <= CTL; ++addr)
+            {
+                if(!addrs[addr]) continue;
+                bool fresh = true;
+                for(int d = 1; d <= devices; ++d) fresh &= __cacheFresh(d, addr);
+                if(!fresh) stale.push_back(addr);
+            }
+            if(stale.empty()) return 0;
+            RegisterSet read;
+            read.regs.assign(devices, {});
+            read.diag.assign(devices, bitset<16>(0xFFFF));
+            int result = 0;
+            for(int d = 1; d <= devices && result >= 0; d = __lastOnFrame(d) + 1) result = __readRegisterSet(d, stale, read);
+            return result;
+        }
+
+        //16-bit word received at frame[offset] (MSB first). Bytes are unsigned so the low byte doesn't sign-extend over the high one
+        static uint16_t __frameWord(const char* frame, int offset) {return (unsigned char)frame[offset] << 8 | (unsigned char)frame[offset+1];}
+
         //daisy-chained is always channel 0. Otherwise spiChannel(1) is 0, spiChannel(2) is 1.
         constexpr int spiChannel(const int device) {return !daisyChain && device == 2;}
 
@@ -134,13 +950,34 @@ class TLE7230
         int SpiWriteAndRead (int channel, char *Buffer, int Length)
         {
             int h = channel ? spiHandles.second : spiHandles.first;
-            
+
             if(h < 0)
             {
                 cerr<<"error: spi handle for channel "<<channel<<" doesn't exist\n";
                 return -1;
             }
-            return spi_xfer(PI, h, Buffer, Buffer, Length);
+#ifdef TLE7230_STATS
+            stats[currentOp].transfers.fetch_add(1, memory_order_relaxed);
+            stats[currentOp].bytes.fetch_add(Length, memory_order_relaxed);
+#endif
+            return io->spiXfer(h, Buffer, Length);
+        }
+
+        //same as SpiWriteAndRead for several frames with a chip-select edge between each
+        int SpiWriteAndReadFrames (int channel, char *Buffer, int frameLength, int frames)
+        {
+            int h = channel ? spiHandles.second : spiHandles.first;
+
+            if(h < 0)
+            {
+                cerr<<"error: spi handle for channel "<<channel<<" doesn't exist\n";
+                return -1;
+            }
+#ifdef TLE7230_STATS
+            stats[currentOp].transfers.fetch_add(frames, memory_order_relaxed);
+            stats[currentOp].bytes.fetch_add(frameLength*frames, memory_order_relaxed);
+#endif
+            return io->spiXferFrames(h, Buffer, frameLength, frames);
         }
 
 //*******************************************************************************************************************
@@ -161,193 +998,843 @@ class TLE7230
         static constexpr int RELAY_CH_OPEN      = 0b01; //open load/open circuit
         static constexpr int RELAY_CH_SHORT2GND = 0b00; //short to ground
 
+        // A list of register operations for execute(), which sends them in as few frames as it can:
+        //     writes to the same register of a device merge (last one wins), relay on/off merge into that device's CTL write,
+        //     and operations for different devices share daisy-chain frames (chip-selects: back-to-back frames per device).
+        // Per device execute() runs the reset first, then the merged writes, then the reads, so reads see the batch's writes.
+        // Each add method returns the index of its result in the vector execute() returns.
+        class Batch
+        {
+            public:
+                enum Kind {WRITE, RELAYS_ON, RELAYS_OFF, READ, RESET, DIAGNOSIS};
+                struct Op
+                {
+                    Kind kind;
+                    int device;
+                    char addr;
+                    char data; //WRITE: data, RELAYS_x: relay mask
+                };
+
+                size_t writeRegister(int device, char addr, char data)
+                {
+                    if(addr < 1 || addr > 8) throw runtime_error("invalid address; Batch::writeRegister()");
+                    return __add(WRITE, device, addr, data);
+                }
+                size_t turnRelayOn(int device, int relay)  {return __add(RELAYS_ON, device, CTL, __relayBit(relay));}
+                size_t turnRelayOff(int device, int relay) {return __add(RELAYS_OFF, device, CTL, __relayBit(relay));}
+                size_t turnRelaysOn(int device, bitset<8> relays)  {return __add(RELAYS_ON, device, CTL, relays.to_ulong());}
+                size_t turnRelaysOff(int device, bitset<8> relays) {return __add(RELAYS_OFF, device, CTL, relays.to_ulong());}
+                size_t readRegister(int device, char addr)
+                {
+                    if(addr < 1 || addr > 8) throw runtime_error("invalid address; Batch::readRegister()");
+                    return __add(READ, device, addr, 0);
+                }
+                size_t resetRegisters(int device) {return __add(RESET, device, 0, 0);}
+                size_t updateDiagStatus(int device) {return __add(DIAGNOSIS, device, 0, 0);}
 
+                // Any operation, e.g. one that was queued or came over the wire; checked like the methods above
+                // @throws runtime_error on an invalid kind, address or relay mask
+                size_t add(const Op& op)
+                {
+                    switch(op.kind)
+                    {
+                        case WRITE:      return writeRegister(op.device, op.addr, op.data);
+                        case RELAYS_ON:  return turnRelaysOn(op.device, bitset<8>((unsigned char)op.data));
+                        case RELAYS_OFF: return turnRelaysOff(op.device, bitset<8>((unsigned char)op.data));
+                        case READ:       return readRegister(op.device, op.addr);
+                        case RESET:      return resetRegisters(op.device);
+                        case DIAGNOSIS:  return updateDiagStatus(op.device);
+                    }
+                    throw runtime_error("invalid operation; Batch::add()");
+                }
+
+                // For front-ends that merge queued operations into batches (TLE7230Worker, TLE7230Executor ...): execute()
+                // runs a device's writes before its reads, so a write, relay change or reset queued after a read of the
+                // same device would overtake it. @return whether op has to wait for the next batch to keep queue order
+                bool mustFollow(const Op& op) const
+                {
+                    bool changes = op.kind != READ && op.kind != DIAGNOSIS;
+                    return changes && op.device >= 0 && size_t(op.device) < reads.size() && reads[op.device];
+                }
+
+                const vector<Op>& operations() const {return ops;}
+                size_t size() const {return ops.size();}
+                bool empty() const {return ops.empty();}
+                void clear()
+                {
+                    ops.clear();
+                    fill(reads.begin(), reads.end(), false);
+                }
+
+            private:
+                vector<Op> ops;
+                vector<bool> reads; //reads[device]: the batch reads from device, see mustFollow()
+
+                size_t __add(Kind kind, int device, char addr, char data)
+                {
+                    ops.push_back(Op{kind, device, addr, data});
+                    if(kind == READ && device >= 0)
+                    {
+                        if(size_t(device) >= reads.size()) reads.resize(device + 1, false);
+                        reads[device] = true;
+                    }
+                    return ops.size() - 1;
+                }
+
+                static char __relayBit(int relay)
+                {
+                    if(relay < 1 || relay > 8) throw runtime_error("invalid relay; Batch");
+                    return 1 << (relay-1);
+                }
+        };
+
+        // Desired contents of the writable registers (MAP, BOL, OVL, OVT, SLE, CTL) of every device, for apply().
+        // Registers never set are left alone
+        class Profile
+        {
+            public:
+                // @param devices getDeviceCount() of the driver it will be applied to
+                Profile(int devices) : value(devices), wanted(devices)
+                {
+                    if(devices < 1) throw runtime_error("invalid device count; Profile()");
+                }
 
-        // Class handles TLE7230 stuff for BOTH devices, so only create one.
+                // @param device 1 to getDeviceCount() @param addr MAP, BOL, OVL, OVT, SLE or CTL @throws runtime_error
+                Profile& set(int device, char addr, unsigned char data)
+                {
+                    __check(device, addr);
+                    value[device-1][addr] = data;
+                    wanted[device-1].set(addr);
+                    return *this;
+                }
+                // same register, same value on every device
+                Profile& setAll(char addr, unsigned char data)
+                {
+                    for(int d = 1; d <= getDeviceCount(); ++d) set(d, addr, data);
+                    return *this;
+                }
+                Profile& unset(int device, char addr)
+                {
+                    __check(device, addr);
+                    wanted[device-1].reset(addr);
+                    return *this;
+                }
+
+                bool isSet(int device, char addr) const {return wanted.at(device-1)[addr];}
+                unsigned char get(int device, char addr) const {return value.at(device-1).at(addr);}
+                bitset<8> registers(int device) const {return wanted.at(device-1);}
+                int getDeviceCount() const {return value.size();}
+
+                // Writes the profile to path, replacing it only once the new file is complete (a crash leaves the old one)
+                // @throws runtime_error if it can't be written
+                void save(const string& path) const
+                {
+                    string temp = path + ".tmp";
+                    FILE* f = fopen(temp.c_str(), "wb");
+                    if(!f) throw runtime_error("could not create " + temp + "; Profile::save()");
+                    uint32_t header[2] = {FILE_VERSION, (uint32_t)getDeviceCount()};
+                    bool ok = fwrite(FILE_MAGIC, 8, 1, f) == 1 && fwrite(header, sizeof header, 1, f) == 1;
+                    for(int d = 0; d < getDeviceCount() && ok; ++d)
+                    {
+                        unsigned char mask = wanted[d].to_ulong();
+                        ok = fwrite(&mask, 1, 1, f) == 1 && fwrite(value[d].data(), 8, 1, f) == 1;
+                    }
+                    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+                    fclose(f);
+                    if(!ok || rename(temp.c_str(), path.c_str()) < 0)
+                    {
+                        unlink(temp.c_str());
+                        throw runtime_error("could not write " + path + "; Profile::save()");
+                    }
+                }
+
+                // @return the profile save() wrote to path @throws runtime_error if it can't be read or isn't one
+                static Profile load(const string& path)
+                {
+                    unique_ptr<FILE, int(*)(FILE*)> f(fopen(path.c_str(), "rb"), fclose);
+                    if(!f) throw runtime_error("could not open " + path + "; Profile::load()");
+                    char magic[8];
+                    uint32_t header[2];
+                    if(fread(magic, 8, 1, f.get()) != 1 || memcmp(magic, FILE_MAGIC, 8) || fread(header, sizeof header, 1, f.get()) != 1
+                       || header[0] != FILE_VERSION || header[1] < 1 || header[1] > 4096)
+                        throw runtime_error(path + " is not a TLE7230 profile; Profile::load()");
+                    Profile p(header[1]);
+                    for(int d = 0; d < p.getDeviceCount(); ++d)
+                    {
+                        unsigned char mask;
+                        if(fread(&mask, 1, 1, f.get()) != 1 || fread(p.value[d].data(), 8, 1, f.get()) != 1)
+                            throw runtime_error(path + " is truncated; Profile::load()");
+                        for(char addr = MAP; addr <= CTL; ++addr) p.wanted[d][addr] = __cacheable(addr) && (mask >> addr & 1);
+                    }
+                    return p;
+                }
+
+            private:
+                static constexpr char FILE_MAGIC[9] = "TLE7230P";
+                static constexpr uint32_t FILE_VERSION = 1;
+
+                vector<array<unsigned char, 8>> value; //value[device-1][addr]
+                vector<bitset<8>> wanted;
+
+                void __check(int device, char addr)
+                {
+                    if(device < 1 || device > getDeviceCount()) throw runtime_error("invalid device; Profile");
+                    if(!__cacheable(addr)) throw runtime_error("not a writable register; Profile");
+                }
+        };
+
+        // What apply() did
+        struct ApplyResult
+        {
+            struct Mismatch
+            {
+                int device;
+                char addr;
+                unsigned char wanted;
+                unsigned char actual; //read back after the write (compare(): what the device holds)
+            };
+            int status = 0;              //pigpio's SPI R/W return value, negative = error (nothing was verified)
+            int written = 0;             //registers that differed and were written
+            vector<Mismatch> mismatches; //written registers that didn't read back as written
+            bool ok() const {return status >= 0 && mismatches.empty();}
+        };
+
+        // One per Batch operation
+        struct BatchResult
+        {
+            int status = 0;          //pigpio's SPI R/W return value for the frames that carried the operation, negative = error
+            unsigned char value = 0; //READ: register contents. WRITE/RELAYS_x: value written to the register
+            bitset<16> diag = bitset<16>(0xFFFF); //diagnosis word of the device shifted out with the operation (RESET/DIAGNOSIS: after the batch)
+        };
+
+
+
+        // Class handles TLE7230 stuff for ALL devices, so only create one.
         // If using this c++ class, compilation requires flags in:                                                                    "
         //              g++ -pthread [main.cpp] -o [main] -lpigpiod_if2 -lrt -std=c++20                                        "
         //
         //
         //  @attention ***TO RUN YOUR PROGRAM*** Must ensure sure pigpio daemon is running:
-        //                                                                                  shell command => " sudo pigpiod " 
+        //                                                                                  shell command => " sudo pigpiod "
+        //  @param transport: SPI/GPIO access, e.g. a PigpioTransport or a TLE7230Sim. Not owned, must outlive this object.
+        //  @param daisyChain: Is the SPI in daisy-chain configuration with device 1 SPI-out => device 2 SPI-in ? (default: false)
+        //  @param baud: frequency (Hz) of SCLK (default: 4194304)
+        //  @param devices: number of TLE7230s. Must be 2 with chip-selects; any chain length when daisy-chained,
+        //            device 1 is the MOSI-receiving device and device N the MISO-transmitting one. One frame reaches all of them
+        //  @param pins: FLTn/RSTn GPIOs (default: GPIO14/15/16). Chip-selects are the transport's business
+        //  @param start: COLD (default), or WARM to attach to running chips: RSTn isn't touched and nothing is written, the
+        //            registers of every device are read in one pipelined sweep (8 frames per chip-select) to fill the register
+        //            cache, then the diagnosis. Relays stay as they were; compare() checks them against a saved Profile
+        //  @throws runtime_error if spi port cannot be opened, devices is invalid or the warm start's reads fail
+        TLE7230(Transport& transport, bool daisyChain = false, int baud = 4194304, int devices = 2, Pins pins = Pins(), Start start = COLD)
+        : io(&transport), daisyChain(daisyChain), devices(devices), pins(pins)
+        {
+            __open(baud, start);
+        }
+
+#ifndef TLE7230_NO_PIGPIO
         //  @param daisyChain: Is the SPI in daisy-chain configuration with device 1 SPI-out => device 2 SPI-in ? (default: false)
         //  @param baud: frequency (Hz) of SCLK (default: 4194304)
         //  @param PI: (optional) if externally-managed piGPIO instance is being used, this is its handle. Otherwise pass nothing.
         //            default value indicates this module calls pigpio_start(...) in constructor and pigpio_stop(PI) in destructor.
-        //  @throws runtime_error if pigpio handle cannot be acquired or spi port cannot be opened
-        TLE7230(bool daisyChain = false, int baud = 4194304, int PI = 0x42) 
-        : daisyChain(daisyChain), PI(PI)
-        {
-            __externalPiGpioHandle = (PI != 0x42);
-            if(!__externalPiGpioHandle) this->PI = pigpio_start(NULL, NULL);
-            if(this->PI < 0) throw runtime_error(__externalPiGpioHandle ? "invalid external piGPIO handle" : "could not start pigpio");
-            spiHandles = pair<int, int>(spi_open(this->PI, spiChannel(1), baud, SPI_MODE), daisyChain ? -1 : spi_open(this->PI, spiChannel(2), baud, SPI_MODE));
-            if(spiHandles.second < 0 && !daisyChain) throw runtime_error("could not open SPI port 2" + string(spiHandles.first < 0 ? " or 1" : ""));
-            if(spiHandles.first < 0) throw runtime_error("could not open SPI port 1");
-            //set RSTn to output
-            set_mode(this->PI, RSTN, PI_OUTPUT);
-            //set FLTnX to inputs
-            set_mode(this->PI, FLTN1, PI_INPUT);
-            set_mode(this->PI, FLTN2, PI_INPUT);
-            //set_pull_up_down(pi, RSTN, PI_PUD_UP);
-            set_pull_up_down(this->PI, FLTN1, PI_PUD_UP);
-            set_pull_up_down(this->PI, FLTN2, PI_PUD_UP);
-            set_pull_up_down(this->PI, RSTN, PI_PUD_DOWN);
-            buffer = new char[BUFFERLEN];
+        //  @param devices: number of TLE7230s, 2 with chip-selects, chain length when daisy-chained
+        //  @param pins: FLTn/RSTn GPIOs (default: GPIO14/15/16) @param bus: main SPI (default), aux SPI or bit-banged
+        //  @param start: COLD (default) or WARM, see the other constructor
+        //  @throws runtime_error if pigpio handle cannot be acquired, spi port cannot be opened or the warm start's reads fail
+        TLE7230(bool daisyChain = false, int baud = 4194304, int PI = 0x42, int devices = 2, Pins pins = Pins(), SpiBus bus = SpiBus(),
+                Start start = COLD)
+        : ownedTransport(make_unique<PigpioTransport>(PI, bus)), io(ownedTransport.get()), daisyChain(daisyChain), devices(devices), pins(pins)
+        {
+            __open(baud, start);
         }
+#endif
 
 
         ~TLE7230()
         {
-            spi_close(PI, spiHandles.first);
-            if(daisyChain) spi_close(PI, spiHandles.second);
-            if(!__externalPiGpioHandle) pigpio_stop(PI);
+            stopDiagPoller();
+            disableFaultInterrupts();
+            disableDiagHistory();
+            io->spiClose(spiHandles.first);
+            if(!daisyChain) io->spiClose(spiHandles.second);
+            delete[] buffer;
             cout<<"~TLE7230() destructor called\n";
         }
 
-        int getGpioHandle() {return PI;}
-        int getFLTN1() {return gpio_read(PI, FLTN1);}
-        int getFLTN2() {return gpio_read(PI, FLTN2);}
-        int writeRSTn(bool level) {return gpio_write(PI, RSTN, level);}
+        int getGpioHandle() {return io->handle();}
+        Transport& getTransport() {return *io;}
+        int getDeviceCount() {return devices;}
+        bool isDaisyChained() {return daisyChain;}
+        // Outermost operation in progress. Only meaningful on the thread holding the bus, i.e. from inside a Transport's
+        // spi calls (a recording transport labels frames with it); OP_NONE outside any
+        Operation getCurrentOperation() {return currentOp;}
+        int getBaud() {lock_guard<recursive_mutex> lock(busLock); return baud;}
+
+        // Reopens the spi channel(s) at another SCLK frequency, between frames (takes the bus lock). Chip state and the
+        // register cache are kept: nothing is sent. See TLE7230Link.h to pick the rate
+        // @param baud SCLK in Hz @throws runtime_error if the channel(s) can't be reopened at baud (the old rate is restored
+        //        if it can be)
+        void setBaud(int baud)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            if(baud <= 0) throw runtime_error("invalid baud; setBaud()");
+            int old = this->baud;
+            io->spiClose(spiHandles.first);
+            if(!daisyChain) io->spiClose(spiHandles.second);
+            try {__openSpi(baud);}
+            catch(const runtime_error&)
+            {
+                if(spiHandles.first >= 0) io->spiClose(spiHandles.first);
+                if(spiHandles.second >= 0) io->spiClose(spiHandles.second);
+                __openSpi(old);
+                throw runtime_error("could not reopen SPI at " + to_string(baud) + " Hz; setBaud()");
+            }
+        }
+
+        int getFLTN1() {return io->gpioRead(FLTN1);}
+        int getFLTN2() {return io->gpioRead(FLTN2);}
+        //RSTn low resets every device, so the register cache is dropped
+        int writeRSTn(bool level)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            if(!level) invalidateRegisterCache();
+            return io->gpioWrite(RSTN, level);
+        }
+
+        // Forget every shadowed register value; the next relay toggle re-reads CTL from the device
+        void invalidateRegisterCache()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            for(auto& v : regCacheValid) v.reset();
+        }
+
+        // Shadowed register values older than this are re-read from the device before use (periodic re-sync)
+        // @param lifetime zero (default) keeps cached values until a reset or invalidateRegisterCache()
+        void setRegisterCacheLifetime(chrono::steady_clock::duration lifetime)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            regCacheLifetime = lifetime;
+        }
+
+        // Re-reads every writable register of one device into the register cache (on-demand re-sync)
+        // Daisy-chained the same frames re-read every device in the chain
+        // @param device 1 to getDeviceCount() @return last SpiWriteAndRead rtn from pigpio @throws runtime_error
+        int syncRegisters(int device)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_SYNC_REGISTERS);
+            __checkDevice(device, "syncRegisters()");
+            vector<char> addrs;
+            for(char addr = MAP; addr <= CTL; ++addr) if(__cacheable(addr)) addrs.push_back(addr);
+            RegisterSet out;
+            out.regs.assign(devices, {});
+            out.diag.assign(devices, bitset<16>(0xFFFF));
+            return __readRegisterSet(device, addrs, out);
+        }
+
+        // Re-reads every writable register of every device into the register cache (on-demand re-sync)
+        // @return last SpiWriteAndRead rtn from pigpio @throws runtime_error
+        int syncRegisters()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_SYNC_REGISTERS);
+            int result = 0;
+            for(int d = 1; d <= devices && result >= 0; d = __lastOnFrame(d) + 1) result = syncRegisters(d);
+            return result;
+        }
 
         // Get Diagnosis Status for one TLE7230
         // @return std::bitset<16> with the TLE7230 object's internal diagnosis status object's current value
         // (i.e., copy constructs)
-        // @param device 1 or 2
-        constexpr bitset<16> getDiagStatus(int device) {return bitset<16>(device == 2 ? diagStatus.second : diagStatus.first);}
+        // @param device 1 to getDeviceCount() @throws runtime_error
+        bitset<16> getDiagStatus(int device)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __checkDevice(device, "getDiagStatus()");
+            return bitset<16>(diagStatus[device-1]);
+        }
 
-        // Get Diagnosis Status for both TLE7230s
+        // Get Diagnosis Status for devices 1 and 2
         // @return <std::bitset<16>, std::bitset<16>> with the TLE7230 object's internal diagnosis status object's current value
         // (i.e., copy constructs)
-        // @param device 1 or 2
-        pair<bitset<16>, bitset<16>> getDiagStatus() {return pair<bitset<16>, bitset<16>>(diagStatus);}
+        pair<bitset<16>, bitset<16>> getDiagStatus()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            return pair<bitset<16>, bitset<16>>(diagStatus[0], diagStatus[devices > 1]);
+        }
+
+        // Get Diagnosis Status for every TLE7230
+        // @return copy of the internal diagnosis status, element [device-1]
+        vector<bitset<16>> getDiagStatuses()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            return diagStatus;
+        }
+
+        // Timestamped diagnosis of every device, see getDiagSnapshot()
+        struct DiagSnapshot
+        {
+            chrono::steady_clock::time_point time; //when the newest diagnosis word in it was received (epoch = never)
+            uint64_t sequence = 0;                 //changes with every frame that brought diagnosis, same sequence = same data
+            vector<bitset<16>> diag;               //diag[device-1], same layout as getDiagStatus()
+        };
+
+        // Latest diagnosis without locking and without touching SPI; safe from any number of threads at once.
+        // Every frame the driver exchanges updates it, whoever sent it (caller, batch or the poller)
+        // @param out filled in; its vector is reused so repeated calls don't allocate
+        void getDiagSnapshot(DiagSnapshot& out)
+        {
+            out.diag.resize(devices);
+            out.sequence = __readSnapshot([&](int d, uint16_t word){out.diag[d] = bitset<16>(word);}, out.time);
+        }
+
+        DiagSnapshot getDiagSnapshot()
+        {
+            DiagSnapshot out;
+            getDiagSnapshot(out);
+            return out;
+        }
+
+        // Decodes one diagnosis word with a handful of word operations, no per-relay work
+        // @param previous word to compare with for FaultMasks::changed
+        static constexpr FaultMasks decodeDiag(uint16_t word, uint16_t previous)
+        {
+            FaultMasks m;
+            __decodeDiag(word, previous, &m, 1);
+            return m;
+        }
+        static constexpr FaultMasks decodeDiag(uint16_t word) {return decodeDiag(word, word);}
+
+        // Decodes count words (a chain, or several boards), 4 per 64-bit operation
+        // @param previous count words to compare with for FaultMasks::changed, nullptr: changed stays 0 @param out count masks
+        static void decodeDiag(const uint16_t* words, const uint16_t* previous, int count, FaultMasks* out)
+        {
+            __decodeRun(count, out, [&](int i){return words[i];}, [&](int i){return previous ? previous[i] : words[i];});
+        }
+
+        // The latest diagnosis of every device decoded, lock-free like getDiagSnapshot()
+        // @param out out[device-1], reused so repeated calls don't allocate; changed is 0
+        void getFaultMasks(vector<FaultMasks>& out)
+        {
+            out.resize(devices);
+            chrono::steady_clock::time_point time;
+            __readSnapshot([&](int d, uint16_t word){out[d].word = word;}, time);
+            __decodeMasks(out, nullptr);
+        }
+
+        // For consumers that only want what changed: decodes the latest diagnosis with changed set against last, then
+        // makes last the latest. Lock-free like getDiagSnapshot(); keep one last per consumer
+        // @param last the previous call's snapshot, empty the first time (all channels ok)
+        // @param out out[device-1] @return true if diagnosis arrived since last (relays may still all be unchanged)
+        bool getFaultChanges(DiagSnapshot& last, vector<FaultMasks>& out)
+        {
+            out.resize(devices);
+            last.diag.resize(devices, bitset<16>(0xFFFF));
+            uint64_t sequence = __readSnapshot([&](int d, uint16_t word){out[d].word = word;}, last.time);
+            __decodeMasks(out, &last.diag);
+            for(int d = 0; d < devices; ++d) last.diag[d] = bitset<16>(out[d].word);
+            bool fresh = sequence != last.sequence;
+            last.sequence = sequence;
+            return fresh;
+        }
+
+        // Starts recording every diagnosis word received, from any frame, into a ring of the last capacity records.
+        // With a path the ring is a file mapped MAP_SHARED, so what was recorded is on disk even if the process dies;
+        // reopening a file with the same capacity carries on after its last record, otherwise the file is started over.
+        // All memory is set up here: recording itself doesn't allocate or make system calls.
+        // Replaces any history already enabled
+        // @param capacity records kept (16 bytes each) @param path file to map, empty for memory only
+        // @throws runtime_error if the file can't be created or mapped
+        void enableDiagHistory(size_t capacity, const string& path = "")
+        {
+            if(capacity == 0) throw runtime_error("capacity must be positive; enableDiagHistory()");
+            lock_guard<recursive_mutex> lock(busLock);
+            disableDiagHistory();
+            size_t bytes = sizeof(DiagLogHeader) + capacity*sizeof(DiagRecord);
+            void* map;
+            if(path.empty()) map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            else
+            {
+                int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+                if(fd < 0) throw runtime_error("could not open " + path + "; enableDiagHistory()");
+                if(ftruncate(fd, bytes) < 0)
+                {
+                    ::close(fd);
+                    throw runtime_error("could not size " + path + "; enableDiagHistory()");
+                }
+                map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+            }
+            if(map == MAP_FAILED) throw runtime_error("could not map diagnosis history; enableDiagHistory()");
+            DiagLogHeader* log = (DiagLogHeader*)map;
+            if(!__validDiagLog(log, bytes) || log->capacity != capacity)
+            {
+                memcpy(log->magic, DIAG_LOG_MAGIC, 8);
+                log->version = DIAG_LOG_VERSION;
+                log->recordSize = sizeof(DiagRecord);
+                log->capacity = capacity;
+                log->created = chrono::system_clock::now().time_since_epoch() / chrono::nanoseconds(1);
+                new(&log->written) atomic<uint64_t>(0);
+                memset((void*)(log + 1), 0xFF, capacity*sizeof(DiagRecord)); //check 0xFFFF never matches record 0
+            }
+            diagLogBytes = bytes;
+            diagLogOffset = chrono::system_clock::now().time_since_epoch() - chrono::steady_clock::now().time_since_epoch();
+            diagRecords = (DiagRecord*)(log + 1);
+            diagLog = log;
+        }
+
+        // Stops recording and unmaps the ring (a file keeps what was written)
+        void disableDiagHistory()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            if(!diagLog) return;
+            munmap(diagLog, diagLogBytes);
+            diagLog = nullptr;
+            diagRecords = nullptr;
+            diagLogBytes = 0;
+        }
+
+        // @return the recorded diagnosis words still in the ring, oldest first (empty if history isn't enabled)
+        vector<DiagRecord> getDiagHistory()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            if(!diagLog) return {};
+            return __readDiagLog(diagLog, diagRecords);
+        }
+
+        // Reads a history file written by enableDiagHistory(), e.g. after a crash. While another process is still recording
+        // into it, the records being written at that moment may be skipped
+        // @param header if not null, gets the file's header (its written member is left 0)
+        // @return its records, oldest first @throws runtime_error if it isn't a diagnosis history file
+        static vector<DiagRecord> readDiagHistoryFile(const string& path, DiagLogHeader* header = nullptr)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if(fd < 0) throw runtime_error("could not open " + path + "; readDiagHistoryFile()");
+            off_t bytes = lseek(fd, 0, SEEK_END);
+            void* map = bytes > 0 ? mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+            ::close(fd);
+            if(map == MAP_FAILED) throw runtime_error("could not map " + path + "; readDiagHistoryFile()");
+            const DiagLogHeader* log = (const DiagLogHeader*)map;
+            if(!__validDiagLog(log, bytes))
+            {
+                munmap(map, bytes);
+                throw runtime_error(path + " is not a TLE7230 diagnosis history; readDiagHistoryFile()");
+            }
+            vector<DiagRecord> out = __readDiagLog(log, (const DiagRecord*)(log + 1));
+            if(header)
+            {
+                memcpy(header->magic, log->magic, 8);
+                header->version = log->version;
+                header->recordSize = log->recordSize;
+                header->capacity = log->capacity;
+                header->created = log->created;
+                header->written.store(0);
+            }
+            munmap(map, bytes);
+            return out;
+        }
+
+        // Starts a thread that keeps the diagnosis snapshot fresh by sending DIAGNOSIS_ONLY frames every period.
+        // A chip-select whose devices already shifted out diagnosis within the last period (from any command) is skipped.
+        // Restarts the poller if it is already running
+        // @param period time between polls
+        void startDiagPoller(chrono::steady_clock::duration period)
+        {
+            stopDiagPoller();
+            if(period <= chrono::steady_clock::duration::zero()) throw runtime_error("invalid period; startDiagPoller()");
+            pollPeriod = period;
+            pollerRun = true;
+            poller = thread(&TLE7230::__pollLoop, this);
+        }
+
+        void stopDiagPoller()
+        {
+            {
+                lock_guard<mutex> wait(pollerLock);
+                pollerRun = false;
+            }
+            pollerWake.notify_all();
+            if(poller.joinable()) poller.join();
+        }
+
+        // Reacts to FLTN1/FLTN2 edges instead of polling them: the transport calls back on the edge, a dedicated thread
+        // immediately fetches diagnosis from the device(s) behind that pin and sends every channel whose status changed
+        // to the subscribeFaults() functions. Needs a transport with edge callbacks (pigpio: callback_ex)
+        // @return 0, or negative if the transport can't register the callbacks
+        int enableFaultInterrupts()
+        {
+            disableFaultInterrupts();
+            {
+                lock_guard<recursive_mutex> lock(busLock);
+                for(int d = 0; d < devices; ++d) faultReported[d] = diagStatus[d].to_ulong();
+            }
+            faultRun = true;
+            faultThread = thread(&TLE7230::__faultLoop, this);
+            for(int i = 0; i < 2; ++i)
+            {
+                int gpio = i ? FLTN2 : FLTN1;
+                faultCallbacks[i] = io->gpioCallback(gpio, Transport::EDGE_EITHER, [this](int gpio, int level, uint32_t tick){__faultEdge(gpio);});
+                if(faultCallbacks[i] < 0)
+                {
+                    int result = faultCallbacks[i];
+                    disableFaultInterrupts();
+                    return result;
+                }
+            }
+            return 0;
+        }
+
+        void disableFaultInterrupts()
+        {
+            for(int& id : faultCallbacks) if(id >= 0) {io->gpioCallbackCancel(id); id = -1;}
+            {
+                lock_guard<mutex> wait(faultLock);
+                faultRun = false;
+            }
+            faultWake.notify_all();
+            if(faultThread.joinable()) faultThread.join();
+        }
 
-        //get status for specified device (1 or 2) and relay
+        // @param fn called on the fault thread for every FaultEvent, outside the bus lock (may call back into the driver)
+        // @return id for unsubscribeFaults()
+        int subscribeFaults(function<void(const FaultEvent&)> fn)
+        {
+            lock_guard<mutex> subs(subscriberLock);
+            faultSubscribers.emplace_back(nextSubscriber, move(fn));
+            return nextSubscriber++;
+        }
+
+        void unsubscribeFaults(int id)
+        {
+            lock_guard<mutex> subs(subscriberLock);
+            erase_if(faultSubscribers, [id](auto& s){return s.first == id;});
+        }
+
+        // Per-operation counters and latency percentiles, one entry per Operation that has been called.
+        // Without TLE7230_STATS defined at compile time nothing is counted and this is empty.
+        // Reads relaxed atomics, no lock: safe to call from a monitoring thread while the bus is busy
+        vector<OpStats> getStats()
+        {
+            vector<OpStats> out;
+#ifdef TLE7230_STATS
+            for(int op = 0; op < OP_COUNT; ++op)
+            {
+                OpCounters& c = stats[op];
+                OpStats s;
+                s.name = OPERATION_NAMES[op];
+                s.calls = c.calls.load(memory_order_relaxed);
+                s.transfers = c.transfers.load(memory_order_relaxed);
+                s.bytes = c.bytes.load(memory_order_relaxed);
+                s.max = chrono::nanoseconds(c.maxNs.load(memory_order_relaxed));
+                if(!s.calls && !s.transfers) continue;
+                unsigned long long total = 0, seen = 0;
+                for(auto& b : c.histogram) total += b.load(memory_order_relaxed);
+                //ceiling ranks: the sample p50/p99 land on, 1-based (one sample is its own p50 and p99)
+                unsigned long long rank50 = (total + 1)/2, rank99 = (total*99 + 99)/100;
+                for(int b = 0; b < HISTOGRAM_BUCKETS && total; ++b)
+                {
+                    unsigned long long n = c.histogram[b].load(memory_order_relaxed);
+                    if(seen < rank50 && seen + n >= rank50) s.p50 = chrono::nanoseconds(__bucketFloor(b+1));
+                    if(seen < rank99 && seen + n >= rank99) s.p99 = chrono::nanoseconds(__bucketFloor(b+1));
+                    seen += n;
+                }
+                s.p50 = min(s.p50, s.max);
+                s.p99 = min(s.p99, s.max);
+                out.push_back(s);
+            }
+#endif
+            return out;
+        }
+
+        void resetStats()
+        {
+#ifdef TLE7230_STATS
+            for(OpCounters& c : stats)
+            {
+                c.calls = c.transfers = c.bytes = c.maxNs = 0;
+                for(auto& b : c.histogram) b = 0;
+            }
+#endif
+        }
+
+        // Prints getStats() as a table
+        void printStats()
+        {
+            printf("%-18s %10s %10s %10s %12s %12s %12s\n", "operation", "calls", "xfers", "bytes", "p50 (us)", "p99 (us)", "max (us)");
+            for(const OpStats& s : getStats())
+                printf("%-18s %10llu %10llu %10llu %12.2f %12.2f %12.2f\n", s.name, s.calls, s.transfers, s.bytes,
+                       s.p50.count()/1e3, s.p99.count()/1e3, s.max.count()/1e3);
+        }
+
+        // @return DIAGNOSIS_ONLY frames sent by the poller, and polls it skipped because other traffic had already brought diagnosis
+        pair<unsigned long long, unsigned long long> getDiagPollerStats() {return pair<unsigned long long, unsigned long long>(pollFrames, pollSkips);}
+
+        //get status for specified device (1 to getDeviceCount()) and relay
         int relayStatus(int device, int relay)
         {
-            return __diagStatus(device)[relay*2-1]<<1 | __diagStatus(device)[relay*2-2]; //use private version
+            lock_guard<recursive_mutex> lock(busLock);
+            __checkDevice(device, "relayStatus()");
+            const bitset<16>& d = diagStatus[device-1];
+            return d[relay*2-1]<<1 | d[relay*2-2];
         }
 
         //prints contents of diagStatus to console in easy to read format
         void printDiagStatus()
         {
-            for(int d = 1; d <= 2; ++d)
+            vector<FaultMasks> masks;
+            getFaultMasks(masks);
+            for(int d = 1; d <= devices; ++d)
+            {
+                const FaultMasks& m = masks[d-1];
                 for(int r = 1; r <= 8; ++r)
-                    switch(relayStatus(d, r))
-                    {
-                        case RELAY_CH_OK       :
-                            printf("DEVICE %d RELAY %d: NORMAL FUNCTION\n", d, r);        
-                            break;
-                        case RELAY_CH_OVERLOAD :
-                            printf("DEVICE %d RELAY %d: SHORT CIRCUIT/OVERLOAD\n", d, r);
-                            break;
-                        case RELAY_CH_OPEN     :
-                            printf("DEVICE %d RELAY %d: OPEN LOAD\n", d, r);              
-                            break;
-                        default                :
-                            printf("DEVICE %d RELAY %d: SHORT TO GROUND\n", d, r);
-                    }
+                {
+                    unsigned char bit = 1 << (r-1);
+                    const char* status = m.ok & bit ? "NORMAL FUNCTION" : m.overload & bit ? "SHORT CIRCUIT/OVERLOAD" :
+                                         m.open & bit ? "OPEN LOAD" : "SHORT TO GROUND";
+                    printf("DEVICE %d RELAY %d: %s\n", d, r, status);
+                }
+            }
         }
 
 
-        // Sends a DIAGNOSIS_ONLY command to the TLE92104R
+        // Sends a DIAGNOSIS_ONLY command to every TLE7230 (one frame when daisy-chained)
         // @buffer will contain the diagStatus afterward
         int updateDiagStatus()
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_UPDATE_DIAG_STATUS);
             //cout<<"updateDiagStatus()\n";
-            if(!daisyChain)
+            int result = 0;
+            for(int d = 1; d <= devices; d = __lastOnFrame(d) + 1)
             {
-                buffer[0] = DIAGNOSIS_ONLY;
-                int result = SpiWriteAndRead(spiChannel(1), buffer, 2);
+                __clearFrame();
+                result = __transfer(d);
                 if(result < 0) return result;
-                diagStatus.first = bitset<16>((buffer[0] << 8) | buffer[1]);
-                //printf("DiagStatus 1: %#x %#x", buffer[0], buffer[1]);
-                buffer[0] = 0x00;
-                result = SpiWriteAndRead(spiChannel(2), buffer, 2);
-                if(result < 0) return result;
-                diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-                //printf(" DiagStatus 2: %#x %#x\n", buffer[0], buffer[1]);
-                return result;
             }
-            buffer[0]  = DIAGNOSIS_ONLY;
-            buffer[2]  = DIAGNOSIS_ONLY; //the other bytes are don't care
-            int result = SpiWriteAndRead(spiChannel(1), buffer, 4);
-            if(result < 0) return result;
-            diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-            diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-            //printf("DiagStatus 1: %#x %#x DiagStatus2: %#x %#x\n", buffer[2], buffer[3], buffer[0], buffer[1]);
             return result;
         }
 
 
-        // @attention DAISY-CHAIN ONLY @throws runtime_error
-        // @param addr1 address of register in MOSI-receiving device @param addr2 address of register in MISO-transmitting device
-        // @return pair<vector<char>, vector<char>> where rtn.first = contents of register @ addr1 of MOSI-receiving device
-        //           and rtn.second = contents of register @ addr2 of MISO-transmitting device.
+        // One register per device. Daisy-chained this is one read for the whole chain (2 frames)
+        // @param addrs addrs[d-1] = address to read on device d, 0 to skip device d. Size getDeviceCount()
+        // @return rtn[d-1] = contents of register addrs[d-1] of device d (0 if skipped) @throws runtime_error
+        vector<char> readRegisters(const vector<char>& addrs)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_READ_REGISTERS);
+            vector<char> out;
+            if(__readRegisters(addrs, out) < 0) throw runtime_error("spi communication failed; readRegisters()");
+            return out;
+        }
+
+        // Reads the same registers from every device, pipelined: each frame carries the next read and brings back the
+        // answer to the one before, so K registers are K+1 frames per chip-select (daisy-chained: K+1 frames in all)
+        // @param addrs addresses to read, MAP to CTL @return their contents for every device @throws runtime_error
+        RegisterSet readRegisterSet(const vector<char>& addrs)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_READ_REGISTER_SET);
+            RegisterSet out;
+            out.regs.assign(devices, {});
+            out.diag.assign(devices, bitset<16>(0xFFFF));
+            for(char a : addrs)
+            {
+                __checkAddress(a, "readRegisterSet()");
+                if(a > CTL) throw runtime_error("invalid address; readRegisterSet()");
+                out.read.set(a);
+            }
+            for(int d = 1; d <= devices; d = __lastOnFrame(d) + 1)
+                if(__readRegisterSet(d, addrs, out) < 0) throw runtime_error("spi communication failed; readRegisterSet()");
+            out.time = chrono::steady_clock::now();
+            return out;
+        }
+
+        // Every register (MAP to CTL) of every device, see readRegisterSet(). 8 frames per chip-select
+        // @throws runtime_error
+        RegisterSet readAllRegisters()
+        {
+            return readRegisterSet({MAP, BOL, OVL, OVT, SLE, STA, CTL});
+        }
+
+        // @param addr1 address of register in device 1 (MOSI-receiving device) @param addr2 address of register in device 2
+        // @return pair<char, char> where rtn.first = contents of register @ addr1 of device 1
+        //           and rtn.second = contents of register @ addr2 of device 2. @throws runtime_error
         pair<char, char> readRegisters(char addr1, char addr2)
         {
-            if(__readRegisters(addr1, addr2) < 0) throw runtime_error("spi communication failed");
-            return pair<char, char>(buffer[3], buffer[1]);
+            vector<char> addrs(devices, 0);
+            addrs[0] = addr1;
+            if(devices < 2) throw runtime_error("readRegisters(addr1, addr2) needs 2 devices");
+            addrs[1] = addr2;
+            vector<char> out = readRegisters(addrs);
+            return pair<char, char>(out[0], out[1]);
         }
 
-        // @attention DAISY-CHAIN ONLY @throws runtime_error
-        // @param addr1 address of register in MOSI-receiving device @param addr2 address of register in MISO-transmitting device
-        // @return pair<vector<char>, vector<char>> where rtn.first = contents of register @ addr1 of MOSI-receiving device
-        //           and rtn.second = contents of register @ addr2 of MISO-transmitting device.
+        // @param addr address of register to read on devices 1 and 2
+        // @return pair<char, char> where rtn.first = contents of register @ addr of device 1
+        //           and rtn.second = contents of register @ addr of device 2. @throws runtime_error
         pair<char, char> readRegisters(char addr)
         {
             return readRegisters(addr, addr);
         }
 
         // @param addr address of register @param device 1: SPI ch1 device / MOSI receiving device (daisy-chain)
-        //                                      2: SPI ch2 device / MISO-transmitting device (daisy-chain).
+        //                                      2: SPI ch2 device / next device in the chain ... N: MISO-transmitting device
         // @return contents
         // @throws runtime_error
         char readRegister(int device, char addr)
         {
-            if((!daisyChain ? __readRegister(device, addr) : __readRegisters(addr)) < 0) throw runtime_error("spi communication failed' readRegister()");
-            //for(int i = 0; i < BUFFERLEN; ++i) printf("Buffer[%d]: %#x\n", i, buffer[i]);
-            return buffer[((daisyChain & device == 1) << daisyChain) + 1/*branchless!*/]; // [0:MSB2][1:LSB2][2:MSB1][3:LSB1]
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_READ_REGISTER);
+            if(__readRegister(device, addr) < 0) throw runtime_error("spi communication failed' readRegister()");
+            return buffer[__offset(device)+1];
         }
 
-        // writes 2 registers, one for each device, 2 different addresses w/ 2 different data
-        // @param addr1 address for SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param addr2 address for SPI CH2 / MISO-transmitting device
-        // @param data1 written to SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param data2 written to SPI CH2 / MISO-transmitting device
+        // writes one register per device, daisy-chained all in the same frame
+        // @param addrs addrs[d-1] = address written on device d, 0 to leave device d alone. Size getDeviceCount()
+        // @param data  data[d-1] = data written to device d
         // @return pigpio's SPI R/W return value (last time called)
         // @throws runtime_error
-        int writeRegisters(char addr1, char addr2, char data1, char data2)
+        int writeRegisters(const vector<char>& addrs, const vector<char>& data)
         {
-            if(addr1 < 1 || addr1 > 8) throw runtime_error(string("invalid address1").append(" and address 2", 14*(addr2 < 1 || addr2 > 8)) + "; writeRegisters()");
-            if(addr2 < 1 || addr2 > 8) throw runtime_error("invalid address2; writeRegisters()\n");
-            if(daisyChain)
-            {
-                //buffer (tx and rx):  [3:LSB1][2:MSB1][1:LSB2][0:MSB2]
-                buffer[0] = WRITE_REGISTER | addr2;
-                buffer[2] = WRITE_REGISTER | addr1;
-                buffer[1] = data2;
-                buffer[3] = data1;
-                int result = SpiWriteAndRead(spiChannel(1), buffer, 4);
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_WRITE_REGISTERS);
+            if((int)addrs.size() != devices || (int)data.size() != devices) throw runtime_error("need one address and data per device; writeRegisters()");
+            for(char a : addrs) if(a) __checkAddress(a, "writeRegisters()");
+            int result = 0;
+            for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+            {
+                bool any = false;
+                __clearFrame();
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                    if(addrs[d-1]) {__put(d, WRITE_REGISTER | addrs[d-1], data[d-1]); any = true;}
+                if(!any) continue;
+                result = __transfer(device);
                 if(result < 0) return result;
-                diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-                diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-                return result;
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                    if(addrs[d-1]) __cacheStore(d, addrs[d-1], data[d-1]);
             }
-            buffer[0] = WRITE_REGISTER | addr1;
-            buffer[1] = data1;
-            int result = SpiWriteAndRead(spiChannel(1), buffer, 2);
-            if(result < 0) return result;
-            diagStatus.first = bitset<16>((buffer[0] << 8) | buffer[1]);
-            buffer[0] = WRITE_REGISTER | addr2;
-            buffer[1] = data2;
-            result = SpiWriteAndRead(spiChannel(2), buffer, 2);
-            if(result < 0) return result;
-            diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
             return result;
         }
 
-        // writes 2 registers, one for each device, 1 address w/ 2 different data
+        // writes 2 registers, one for each of devices 1 and 2, 2 different addresses w/ 2 different data
+        // @param addr1 address for SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param addr2 address for SPI CH2 / device 2
+        // @param data1 written to SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param data2 written to SPI CH2 / device 2
+        // @return pigpio's SPI R/W return value (last time called)
+        // @throws runtime_error
+        int writeRegisters(char addr1, char addr2, char data1, char data2)
+        {
+            if(addr1 < 1 || addr1 > 8) throw runtime_error(string("invalid address1").append(" and address 2", 14*(addr2 < 1 || addr2 > 8)) + "; writeRegisters()");
+            if(addr2 < 1 || addr2 > 8) throw runtime_error("invalid address2; writeRegisters()\n");
+            if(devices < 2) throw runtime_error("writeRegisters(addr1, addr2, data1, data2) needs 2 devices");
+            vector<char> addrs(devices, 0), data(devices, 0);
+            addrs[0] = addr1; data[0] = data1;
+            addrs[1] = addr2; data[1] = data2;
+            return writeRegisters(addrs, data);
+        }
+
+        // writes 2 registers, one for each of devices 1 and 2, 1 address w/ 2 different data
         // @param addr address
-        // @param data1 written to SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param data2 written to SPI CH2 / MISO-transmitting device
+        // @param data1 written to SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param data2 written to SPI CH2 / device 2
         // @return pigpio's SPI R/W return value (last time called)
         // @throws runtime_error
         int writeRegisters(char addr, char data1, char data2)
@@ -355,165 +1842,137 @@ class TLE7230
             return writeRegisters(addr, addr, data1, data2);
         }
 
-        // writes 2 registers, one for each device, 1 address, 1 data
+        // writes the same register of every device, 1 address, 1 data
         // @param addr address
-        // @param data1 written to SPI CH1 / MOSI-receiving device (depends if daisy-chained) @param data2 written to SPI CH2 / MISO-transmitting device
+        // @param data written to every device
         // @return pigpio's SPI R/W return value (last time called)
         // @throws runtime_error
         int writeRegisters(char addr, char data)
         {
-            return writeRegisters(addr, data, data);
+            __checkAddress(addr, "writeRegisters()");
+            return writeRegisters(vector<char>(devices, addr), vector<char>(devices, data));
         }
 
-        // This will only write the register for 1 device and if daisy chained send a get diagnosis commmand for the other.
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // This will only write the register for 1 device and if daisy chained send a get diagnosis commmand for the others.
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @param addr address to which to write data
         // @param data data to write to addr
         // @throws runtime_error
         // @return last SpiWriteAndRead rtn from pgiop
         int writeRegister(int device, char addr, char data)
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_WRITE_REGISTER);
             //cout<<"writeRegister()\n";
-            if(device < 1 || device > 2) throw runtime_error("invalid device; writeRegister()");
-            if(addr < 1 || addr > 8)throw runtime_error("invalid address; writeRegister()");
-            if(daisyChain)
-            {
-                //buffer tx/rx:  [3:LSB1][2:MSB1][1:LSB2][0:MSB2]
-                buffer[0] = DIAGNOSIS_ONLY;
-                buffer[2] = DIAGNOSIS_ONLY;
-                buffer[(2-device)*2] = WRITE_REGISTER | addr;
-                buffer[(2-device)*2+1] = data;
-                int result = SpiWriteAndRead(spiChannel(1), buffer, 4);
-                if(result < 0) return result;
-                diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-                diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-                return result;
-            }
-            buffer[0] = WRITE_REGISTER | addr;
-            buffer[1] = data;
+            __checkDevice(device, "writeRegister()");
+            __checkAddress(addr, "writeRegister()");
+            __clearFrame();
+            __put(device, WRITE_REGISTER | addr, data);
             //printf("SPI_OUT to device %d: %#x %#x\n", device, buffer[0], buffer[1]);
-            int result = SpiWriteAndRead(spiChannel(device), buffer, 2);
+            int result = __transfer(device);
             //cout<<"SpiWriteAndRead() rtn: "<<result<<'\n';
             if(result < 0) return result;
-            (device == 1 ? diagStatus.first : diagStatus.second) = bitset<16>((buffer[0] << 8) | buffer[1]);
-            //printf("diagnostics shifted out during write command: %#x %#x\n", buffer[0], buffer[1]);
+            __cacheStore(device, addr, data);
             return result;
         }
 
         // Resets logic registers to defaults, one device only
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @throws runtime_error
         // @return last SpiWriteAndRead rtn from pgiop
         int resetRegisters(int device)
         {
-            if(device < 1 || device > 2) throw runtime_error("invalid device; writeRegister()");
-            if(daisyChain)
-            {
-                buffer[0] = DIAGNOSIS_ONLY; //don't reset device that isn't passed to method
-                buffer[2] = DIAGNOSIS_ONLY;
-                buffer[(2-device)*2] = RESET_DEVICE;
-                int result = SpiWriteAndRead(spiChannel(device), buffer, 4);
-                if(result < 0) return result;
-                diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-                diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-                return result;
-            }
-            buffer[0] = RESET_DEVICE;
-            //buffer[1] = RESET_DEVICE; //don't care
-            int result = SpiWriteAndRead(spiChannel(device), buffer, 2);
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_RESET_REGISTERS);
+            __checkDevice(device, "resetRegisters()");
+            regCacheValid[device-1].reset();
+            __clearFrame(); //don't reset devices that aren't passed to method
+            __put(device, RESET_DEVICE);
+            int result = __transfer(device);
             if(result < 0) throw runtime_error("SPI communication failed");
-            (device == 1 ? diagStatus.first : diagStatus.second) = bitset<16>((buffer[0] << 8) | buffer[1]);
             return result;
         }
 
-        // Resets both devices' logic registers to defaults, one device only
+        // Resets every device's logic registers to defaults
         // @throws runtime_error
         // @return last SpiWriteAndRead rtn from pgiop
         int resetRegisters()
         {
-            if(daisyChain)
-            {
-                buffer[0] = RESET_DEVICE; //don't reset device that isn't passed to method
-                buffer[2] = RESET_DEVICE;
-                int result = SpiWriteAndRead(spiChannel(1), buffer, 4);
-                if(result < 0) throw runtime_error("SPI communication failed");
-                diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
-                diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-                return result;
-            }
-            buffer[0] = RESET_DEVICE;
-            //buffer[1] = RESET_DEVICE; //don't care
-            int result = SpiWriteAndRead(spiChannel(1), buffer, 2);
-            if(result < 0) throw runtime_error("SPI communication failed w/ device 1");
-            diagStatus.first  = bitset<16>((buffer[2] << 8) | buffer[3]);
-            buffer[0] = RESET_DEVICE;
-            //buffer[1] = RESET_DEVICE; //don't care
-            result = SpiWriteAndRead(spiChannel(2), buffer, 2);
-            if(result < 0) throw runtime_error("SPI communication failed w/ device 2");
-            diagStatus.second = bitset<16>((buffer[0] << 8) | buffer[1]);
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_RESET_REGISTERS);
+            invalidateRegisterCache();
+            int result = 0;
+            for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+            {
+                __clearFrame();
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d) __put(d, RESET_DEVICE);
+                result = __transfer(device);
+                if(result < 0) throw runtime_error("SPI communication failed w/ device " + to_string(device));
+            }
             return result;
         }
 
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @param relay 1 to 8, the OUTx channel of TLE7230
         // @throws runtime_error
         // @return last SpiWriteAndRead rtn from pgiop
         int turnRelayOn(int device, int relay)
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_TURN_RELAY_ON);
             if(relay < 1 || relay > 8) throw runtime_error("invalid relay; turnRelayOn()");
             //cout<<"turnRelayOn()\n";
-            int result = daisyChain ? __readRegisters(CTL) : __readRegister(device, CTL);
-            if(result < 0) return result;
-            //cout<<"CTL Register State Read\n";
-            //daisychain buffer: [0: MSB2][1: LSB2][2: MSB1][3: LSB1]
-            if(daisyChain) return writeRegister(device, CTL, buffer[(2-device)*2+1] | (0x01 << (relay-1)));
-            return writeRegister(device, CTL, buffer[1] | (0x01 << (relay-1)));
+            int ctl = __shadowRegister(device, CTL);
+            if(ctl < 0) return ctl;
+            return writeRegister(device, CTL, ctl | (0x01 << (relay-1)));
         }
 
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @param relays bitset<8>/vector<bool>/string("[10101010]")/integer([0b01010101])
         //         or collection (e.g. vector<int>, set<int>, unordered_set<int>, list<int>, array<int>) of numbers 1 to 8 for output channel of device
         // @return pigpio SPI return value (if error, negative) @throws runime_exception
         // @attention string literal will be interpreted as a char[], use string("01010011") if not wanting to send e.g., [0x01][0x3][0x06] to turn on 1/3/6
         template <typename T> int turnRelaysOn(int device, T relays)
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_TURN_RELAYS_ON);
             bitset<8> r;
             if constexpr (is_constructible_v<bitset<8>, T>) r = bitset<8>(relays);
             else if constexpr (is_convertible_v<T, vector<bool>>) ranges::for_each(relays, [&r](vector<bool>::reference rl){(r>>=1)[7] = rl;});
             else ranges::for_each(relays, [&r](int &rl){rl >= 1 && rl <= 8 ? r.set(rl-1) : throw runtime_error("invalid relay #");});
-            int result = daisyChain ? __readRegisters(CTL) : __readRegister(device, CTL);
-            if(result < 0) return result;
-            if(daisyChain) return writeRegister(device, CTL, buffer[(2-device)*2+1] | r.to_ullong());
-            return writeRegister(device, CTL, (buffer[1]) | r.to_ullong());
+            int ctl = __shadowRegister(device, CTL);
+            if(ctl < 0) return ctl;
+            return writeRegister(device, CTL, ctl | r.to_ullong());
         }
 
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @param relay 1 to 8, the OUTx channel of TLE7230
         // @throws runtime_error
         // @return last SpiWriteAndRead rtn from pgiop
         int turnRelayOff(int device, int relay)
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_TURN_RELAY_OFF);
             if(relay < 1 || relay > 8)
             {
                 cerr << "invalid relay; turnRelayOff()\n";
                 return -1;
             }
             //cout<<"turnRelayOff()\n";
-            int result = daisyChain ? __readRegisters(CTL) : __readRegister(device, CTL);
-            if(result < 0) return result;
-            //cout<<"CTL Register State Read\n";
-            //daisychain buffer out: [0: MSB2][1: LSB2][2: MSB1][3: LSB1]
-            if(daisyChain) return writeRegister(device, CTL, buffer[(2-device)*2+1] & ~(0x01<<(relay-1)));
-            return writeRegister(device, CTL, buffer[1] & ~(0x01<<(relay-1)));
+            int ctl = __shadowRegister(device, CTL);
+            if(ctl < 0) return ctl;
+            return writeRegister(device, CTL, ctl & ~(0x01<<(relay-1)));
         }
 
-        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / MISO-transmitting device
+        // @param device 1: SPI CH1 / MOSI-receiving device (depends if daisy-chained); 2: SPI CH2 / next device in the chain ...
         // @param relays bitset<8>/vector<bool>/string("[10101010]")/integer([0b01010101])
         //    or collection (e.g. vector<int>, set<int>, unordered_set<int>, list<int>, array<int>) of numbers 1 to 8 for output channel of device
         //   @attention string literal will be interpreted as a char[], use string("[0bxxxxxxxx]") if not wanting to send e.g., [0x01][0x3][0x06] to turn off 1/3/6
         // @return pigpio SPI return value (if error, negative) @throws runime_exception
         template <typename T> int turnRelaysOff(int device, T relays)
         {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_TURN_RELAYS_OFF);
             bitset<8> r;
             if constexpr (is_constructible_v<bitset<8>, T>) r = bitset<8>(relays).flip();
             else if constexpr (is_convertible_v<T, vector<bool>>) ranges::for_each(relays, [&r](vector<bool>::reference rl){(r>>=1)[7]=!rl;});
@@ -522,29 +1981,325 @@ class TLE7230
                 r.set();
                 std::ranges::for_each(relays, [&r](int &rl){rl >= 1 && rl <= 8 ? r.reset(rl-1) : throw runtime_error("invalid relay #");});
             }
-            int result = daisyChain ? __readRegisters(CTL) : __readRegister(device, CTL);
+            int ctl = __shadowRegister(device, CTL);
+            if(ctl < 0) return ctl;
+            return writeRegister(device, CTL, (bitset<8>(ctl) & r).to_ullong());
+        }
+
+        // Current on/off state of every relay (the shadow CTLs; devices not known yet are read, pipelined)
+        // @throws runtime_error if SPI fails
+        RelayState getRelayState()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_GET_RELAY_STATE);
+            RelayState state;
+            if(__relayState(state) < 0) throw runtime_error("spi communication failed; getRelayState()");
+            return state;
+        }
+
+        // Moves every relay of every device to state in one step, no intermediate patterns: daisy-chained a single frame
+        // that all chips latch on the same CSn edge, with chip-selects back-to-back frames. Doesn't read anything first
+        // @param state state[device-1] = CTL for device, size getDeviceCount()
+        // @return pigpio's SPI R/W return value (0: shadow already matched, nothing sent) @throws runtime_error
+        int setRelayState(const RelayState& state)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_SET_RELAY_STATE);
+            __checkRelayState(state, "setRelayState()");
+            return __writeRelayState(state);
+        }
+
+        // Same as setRelayState() with the state packed into one word: bits 8*(device-1) to 8*device-1 are device's CTL
+        // @throws runtime_error with more than 8 devices
+        int setRelayState(uint64_t word)
+        {
+            if(devices > 8) throw runtime_error("more than 8 devices don't fit one word; setRelayState()");
+            RelayState state(devices);
+            for(int d = 1; d <= devices; ++d) state[d-1] = word >> (8*(d-1)) & 0xFF;
+            return setRelayState(state);
+        }
+
+        // Switches the relays in on[] on and the ones in off[] off, every device in the same step (see setRelayState());
+        // a relay in both ends up on. Only reads CTL of devices whose shadow isn't known
+        // @param on,off one mask per device, size getDeviceCount() @return pigpio's SPI R/W return value @throws runtime_error
+        int changeRelayState(const RelayState& on, const RelayState& off)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_SET_RELAY_STATE);
+            __checkRelayState(on, "changeRelayState()");
+            __checkRelayState(off, "changeRelayState()");
+            RelayState state;
+            int result = __relayState(state);
+            if(result < 0) return result;
+            for(int d = 0; d < devices; ++d) state[d] = (state[d] & ~off[d]) | on[d];
+            return __writeRelayState(state);
+        }
+
+        // setRelayState(desired) only if every device's shadow state is expected. Decided and written under the bus lock,
+        // so no other thread using this driver can change the relays in between
+        // @param current if not null, gets the state that was compared (whether or not it matched)
+        // @return 1 if written, 0 if the state didn't match (nothing sent), negative pigpio error @throws runtime_error
+        int compareAndSetRelayState(const RelayState& expected, const RelayState& desired, RelayState* current = nullptr)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_SET_RELAY_STATE);
+            __checkRelayState(expected, "compareAndSetRelayState()");
+            __checkRelayState(desired, "compareAndSetRelayState()");
+            RelayState state;
+            int result = __relayState(state);
             if(result < 0) return result;
-            if(daisyChain) return writeRegister(device, CTL, (bitset<8>(buffer[(2-device)*2+1]) & r).to_ulong());
-            return writeRegister(device, CTL, (bitset<8>(buffer[1]) & r).to_ullong());
+            if(current) *current = state;
+            if(state != expected) return 0;
+            result = __writeRelayState(desired);
+            return result < 0 ? result : 1;
+        }
+
+        // Runs a Batch, see Batch for the order and merging rules. Relay on/off with no CTL value known from the batch
+        // itself takes the shadow CTL (read from the device first if the cache doesn't have it)
+        // Daisy-chained: frames = the most operations any one device ends up with (+1 to clock out trailing reads)
+        // @return one BatchResult per operation, in the order they were added @throws runtime_error on an invalid device
+        vector<BatchResult> execute(const Batch& batch)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_EXECUTE);
+            const vector<Batch::Op>& ops = batch.operations();
+            vector<BatchResult> results(ops.size());
+            for(const Batch::Op& op : ops) __checkDevice(op.device, "execute()");
+
+            //relay on/off needs the current CTL unless a reset or a CTL write earlier in the batch already fixed it
+            vector<bool> ctlFixed(devices, false);
+            for(const Batch::Op& op : ops)
+            {
+                bool relays = op.kind == Batch::RELAYS_ON || op.kind == Batch::RELAYS_OFF;
+                if(relays && !ctlFixed[op.device-1])
+                {
+                    int ctl = __shadowRegister(op.device, CTL);
+                    if(ctl < 0)
+                    {
+                        for(BatchResult& r : results) r.status = ctl;
+                        return results;
+                    }
+                }
+                if(relays || op.kind == Batch::RESET || (op.kind == Batch::WRITE && op.addr == CTL)) ctlFixed[op.device-1] = true;
+            }
+
+            //what each device ends up doing: [RESET] [merged writes, in order of first write] [reads]
+            struct Plan
+            {
+                bool reset = false;
+                bool diagnosis = false;
+                array<int, 8> value;             //merged data per register, -1 = not written
+                vector<char> order;              //written registers in order
+                vector<char> reads;
+                vector<uint16_t> writeDiag;      //diagnosis shifted out in the frame of each write
+                vector<unsigned char> readValue; //answer to each read
+                int frames() const {return reset + order.size() + reads.size();}
+            };
+            vector<Plan> plan(devices);
+            for(Plan& p : plan) p.value.fill(-1);
+            for(const Batch::Op& op : ops)
+            {
+                Plan& p = plan[op.device-1];
+                switch(op.kind)
+                {
+                    case Batch::RESET: p.value.fill(-1); p.order.clear(); p.reset = true; break;
+                    case Batch::WRITE:
+                        if(p.value[op.addr] < 0) p.order.push_back(op.addr);
+                        p.value[op.addr] = (unsigned char)op.data;
+                        break;
+                    case Batch::RELAYS_ON: case Batch::RELAYS_OFF:
+                        if(p.value[CTL] < 0)
+                        {
+                            p.order.push_back(CTL);
+                            p.value[CTL] = p.reset ? 0 : (unsigned char)regCache[op.device-1][CTL];
+                        }
+                        if(op.kind == Batch::RELAYS_ON) p.value[CTL] |= (unsigned char)op.data;
+                        else p.value[CTL] &= ~(unsigned char)op.data;
+                        break;
+                    case Batch::READ: p.reads.push_back(op.addr); break;
+                    case Batch::DIAGNOSIS: p.diagnosis = true; break;
+                }
+            }
+
+            //one run of back-to-back frames per chip-select
+            vector<int> status(devices, 0);
+            int len = __frameLength();
+            for(int device = 1; device <= devices; device = __lastOnFrame(device) + 1)
+            {
+                int frames = 0;
+                bool wanted = false;
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                {
+                    frames = max(frames, plan[d-1].frames());
+                    wanted |= plan[d-1].diagnosis;
+                }
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                    if(!plan[d-1].reads.empty() && plan[d-1].frames() == frames) {++frames; break;} //clock out the last read
+                if(frames == 0 && wanted) frames = 1;
+                if(frames == 0) continue;
+
+                batchFrames.assign(frames*len, DIAGNOSIS_ONLY);
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                {
+                    Plan& p = plan[d-1];
+                    char* f = batchFrames.data() + __offset(d);
+                    if(p.reset) {f[0] = RESET_DEVICE; f += len; regCacheValid[d-1].reset();}
+                    for(char a : p.order) {f[0] = WRITE_REGISTER | a; f[1] = p.value[a]; f += len;}
+                    for(char a : p.reads) {f[0] = READ_REGISTER | a; f += len;}
+                }
+                int result = __transferFrames(device, batchFrames.data(), frames);
+                for(int d = __firstOnFrame(device); d <= __lastOnFrame(device); ++d)
+                {
+                    Plan& p = plan[d-1];
+                    status[d-1] = result;
+                    if(result < 0) continue;
+                    const char* f = batchFrames.data() + __offset(d) + p.reset*len;
+                    for(char a : p.order)
+                    {
+                        __cacheStore(d, a, p.value[a]);
+                        p.writeDiag.push_back(__frameWord(f, 0));
+                        f += len;
+                    }
+                    for(size_t k = 0; k < p.reads.size(); ++k)
+                    {
+                        p.readValue.push_back(f[(k+1)*len + 1]); //answered on the next frame
+                        if(__cacheable(p.reads[k])) __cacheStore(d, p.reads[k], p.readValue.back()); //what the device has, over what was written
+                    }
+                }
+            }
+
+            //hand out results
+            vector<size_t> nthRead(devices, 0);
+            for(size_t i = 0; i < ops.size(); ++i)
+            {
+                const Batch::Op& op = ops[i];
+                Plan& p = plan[op.device-1];
+                BatchResult& r = results[i];
+                r.status = status[op.device-1];
+                r.diag = diagStatus[op.device-1];
+                if(r.status < 0) continue;
+                if(op.kind == Batch::READ) r.value = p.readValue[nthRead[op.device-1]++];
+                if(op.kind == Batch::WRITE || op.kind == Batch::RELAYS_ON || op.kind == Batch::RELAYS_OFF)
+                {
+                    size_t k = find(p.order.begin(), p.order.end(), op.addr) - p.order.begin();
+                    if(k == p.order.size()) continue; //wiped by a later reset in the same batch
+                    r.value = p.value[op.addr];
+                    r.diag = bitset<16>(p.writeDiag[k]);
+                }
+            }
+            return results;
+        }
+
+        // Brings the registers to what profile wants, writing only the ones that differ from the known state (the register
+        // cache, within its lifetime) and reading each written register back to check it stuck. Writes and readbacks go out
+        // as one Batch: writes for different devices share daisy-chain frames, and the readback is pipelined behind them.
+        // Re-applying a profile the cache already matches sends nothing.
+        // @param readFirst read the profile's registers from the devices before comparing (pipelined, see readRegisterSet()),
+        //        for when the cache can't be trusted, e.g. after a brown-out that didn't go through writeRSTn()
+        // @throws runtime_error if profile is for a different number of devices
+        ApplyResult apply(const Profile& profile, bool readFirst = false)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_APPLY);
+            if(profile.getDeviceCount() != devices) throw runtime_error("profile is for a different number of devices; apply()");
+            ApplyResult result;
+            if(readFirst)
+            {
+                bitset<8> any;
+                for(int d = 1; d <= devices; ++d) any |= profile.registers(d);
+                vector<char> addrs;
+                for(char addr = MAP; addr <= CTL; ++addr) if(any[addr]) addrs.push_back(addr);
+                RegisterSet current;
+                current.regs.assign(devices, {});
+                current.diag.assign(devices, bitset<16>(0xFFFF));
+                for(int d = 1; d <= devices && !addrs.empty(); d = __lastOnFrame(d) + 1)
+                {
+                    result.status = __readRegisterSet(d, addrs, current); //fills the cache
+                    if(result.status < 0) return result;
+                }
+            }
+
+            Batch batch;
+            vector<pair<size_t, unsigned char>> checks; //index of the readback, wanted value
+            for(int d = 1; d <= devices; ++d)
+                for(char addr = MAP; addr <= CTL; ++addr)
+                {
+                    if(!profile.isSet(d, addr)) continue;
+                    unsigned char want = profile.get(d, addr);
+                    if(__cacheFresh(d, addr) && (unsigned char)regCache[d-1][addr] == want) continue;
+                    batch.writeRegister(d, addr, want);
+                    checks.emplace_back(batch.readRegister(d, addr), want);
+                }
+            if(batch.empty()) return result;
+            vector<BatchResult> done = execute(batch);
+            result.written = checks.size();
+            for(auto& [i, want] : checks)
+            {
+                const BatchResult& r = done[i];
+                if(r.status < 0) {result.status = r.status; result.mismatches.clear(); return result;}
+                result.status = r.status;
+                const Batch::Op& op = batch.operations()[i];
+                if(r.value != want) result.mismatches.push_back(ApplyResult::Mismatch{op.device, op.addr, want, r.value});
+            }
+            return result;
+        }
+
+        // What the writable registers of every device hold, as a Profile to save() and compare() against or apply() on a
+        // later start. Comes from the register cache; registers without a fresh cached copy are read first (pipelined).
+        // Right after a warm start nothing is read
+        // @throws runtime_error if a read fails
+        Profile getProfile()
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_GET_PROFILE);
+            bitset<8> writable;
+            for(char addr = MAP; addr <= CTL; ++addr) writable[addr] = __cacheable(addr);
+            if(__fillCache(writable) < 0) throw runtime_error("spi communication failed; getProfile()");
+            Profile p(devices);
+            for(int d = 1; d <= devices; ++d)
+                for(char addr = MAP; addr <= CTL; ++addr) if(writable[addr]) p.set(d, addr, regCache[d-1][addr]);
+            return p;
+        }
+
+        // The registers set in profile that the devices don't hold; actual is what they hold. Nothing is written: apply()
+        // restores them. Reads like getProfile(), so right after a warm start this is a check against the registers found
+        // @throws runtime_error if profile is for a different number of devices or a read fails
+        vector<ApplyResult::Mismatch> compare(const Profile& profile)
+        {
+            lock_guard<recursive_mutex> lock(busLock);
+            __OpScope scope(this, OP_COMPARE);
+            if(profile.getDeviceCount() != devices) throw runtime_error("profile is for a different number of devices; compare()");
+            bitset<8> any;
+            for(int d = 1; d <= devices; ++d) any |= profile.registers(d);
+            if(__fillCache(any) < 0) throw runtime_error("spi communication failed; compare()");
+            vector<ApplyResult::Mismatch> out;
+            for(int d = 1; d <= devices; ++d)
+                for(char addr = MAP; addr <= CTL; ++addr)
+                {
+                    unsigned char actual = regCache[d-1][addr];
+                    if(profile.isSet(d, addr) && actual != profile.get(d, addr))
+                        out.push_back(ApplyResult::Mismatch{d, addr, profile.get(d, addr), actual});
+                }
+            return out;
         }
 
         //test script that reads the relevant GPIO pins, writes RST low/high, and then turns each relay on then off for 1 second
         int test()
         {
-            cout<<"PI: "<<PI<<'\n';
-            cout<<"CSn1 read: "<<gpio_read(PI, CSN1)<<" CSn2 read: "<<gpio_read(PI, CSN1);
-            cout<<" FLTn1 read: "<<gpio_read(PI, FLTN1)<<" FLTn2 read: "<<gpio_read(PI, FLTN2)<<'\n';
+            cout<<"PI: "<<io->handle()<<'\n';
+            cout<<"CSn1 read: "<<io->gpioRead(CSN1)<<" CSn2 read: "<<io->gpioRead(CSN1);
+            cout<<" FLTn1 read: "<<io->gpioRead(FLTN1)<<" FLTn2 read: "<<io->gpioRead(FLTN2)<<'\n';
             sleep(1);
             cout<<"write RSTN->low\n";
-            cout<<"gpio_write rtn: "<<gpio_write(PI, RSTN, PI_OFF)<<'\n';
-            cout<<"RSTN read: "<<gpio_read(PI, RSTN)<<'\n';
+            cout<<"gpio_write rtn: "<<writeRSTn(false)<<'\n';
+            cout<<"RSTN read: "<<io->gpioRead(RSTN)<<'\n';
             sleep(1);
             cout<<"write RSTN->high\n";
-            gpio_write(PI, RSTN, PI_ON);
+            writeRSTn(true);
             sleep(1);
-            cout<<"RSTn read: "<<gpio_read(PI, RSTN)<<'\n';
+            cout<<"RSTn read: "<<io->gpioRead(RSTN)<<'\n';
         //turn each relay on + wait1s + turn off, one at a time
-        for(int i = 1; i <= 2; ++i)
+        for(int i = 1; i <= devices; ++i)
         {
             for(int j = 1; j <= 8; ++j)
             {
@@ -558,9 +2313,8 @@ class TLE7230
                 sleep(1);
                 cout<<"slept 1sec\n";
                 updateDiagStatus();
-                cout<<"FLTn1: "<<gpio_read(PI, FLTN1)<<" FLTn2: "<<gpio_read(PI, FLTN2)<<'\n';
-                cout<<"diagnostic status 1: "<<diagStatus.first<<'\n';
-                cout<<"diagnostic status 2: "<<diagStatus.second<<'\n';
+                cout<<"FLTn1: "<<io->gpioRead(FLTN1)<<" FLTn2: "<<io->gpioRead(FLTN2)<<'\n';
+                for(int d = 1; d <= devices; ++d) cout<<"diagnostic status "<<d<<": "<<diagStatus[d-1]<<'\n';
                 cout<<"\n**********************turning off device "<<i<<" channel "<<j<<'\n';
                 result = turnRelayOff(i, j);
                 if(result < 0)
@@ -571,11 +2325,10 @@ class TLE7230
                 sleep(1);
                 cout<<"slept 1sec\n";
                 updateDiagStatus();
-                cout<<"diagnostic status 1: "<<diagStatus.first<<'\n';
-                cout<<"diagnostic status 2: "<<diagStatus.second<<'\n';
+                for(int d = 1; d <= devices; ++d) cout<<"diagnostic status "<<d<<": "<<diagStatus[d-1]<<'\n';
                 printDiagStatus();
             }
         }
         return 0;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,301 @@
+/*****TLE7230Async: C++20 coroutines for the relays, on one event-loop thread ****************************************
+Any number of sequences (board bring-up, timed checks ...) run as coroutines on a TLE7230Executor instead of a thread
+each. Relay/register/diagnosis operations and delays are awaitable; the executor is the bus owner: once every runnable
+coroutine has suspended, the operations they are waiting on go out together as one TLE7230::Batch (shared frames,
+one CTL write per device), and the coroutines resume with their results.
+
+    TLE7230Task bringUp(TLE7230Executor& ex, int device)
+    {
+        co_await ex.writeRegister(device, TLE7230::OVL, 0xFF);
+        for(int relay = 1; relay <= 8; ++relay)
+        {
+            co_await ex.turnRelayOn(device, relay);
+            co_await ex.sleep(chrono::milliseconds(100));
+        }
+        TLE7230::BatchResult r = co_await ex.updateDiagStatus(device);
+        if(r.diag != 0xFFFF) co_await ex.turnRelaysOff(device, 0xFF);
+    }
+
+    TLE7230Executor ex(relays);
+    for(int d = 1; d <= relays.getDeviceCount(); ++d) ex.spawn(bringUp(ex, d));
+    ex.run();   //returns when every spawned task has finished
+
+A task can co_await another TLE7230Task (it runs right away, the caller resumes when it ends). Ordering within one
+iteration follows TLE7230::Batch::mustFollow(), as in TLE7230Worker: the batch is cut before a write or reset that
+follows a read of the same device.
+The executor isn't thread-safe: spawn() and the awaitables belong to the thread running run() (or come before it).
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <coroutine>
+#include <queue>
+#include <utility>
+
+class TLE7230Executor;
+
+// A coroutine run by a TLE7230Executor (spawn()) or awaited by another TLE7230Task
+class TLE7230Task
+{
+    public:
+        struct promise_type
+        {
+            coroutine_handle<> continuation; //task awaiting this one, if any
+            exception_ptr error;
+
+            TLE7230Task get_return_object() {return TLE7230Task(coroutine_handle<promise_type>::from_promise(*this));}
+            suspend_always initial_suspend() noexcept {return {};}
+            auto final_suspend() noexcept
+            {
+                struct Resume
+                {
+                    bool await_ready() noexcept {return false;}
+                    coroutine_handle<> await_suspend(coroutine_handle<promise_type> h) noexcept
+                    {
+                        coroutine_handle<> next = h.promise().continuation;
+                        return next ? next : noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+                return Resume{};
+            }
+            void return_void() {}
+            void unhandled_exception() {error = current_exception();}
+        };
+
+        TLE7230Task(TLE7230Task&& t) noexcept : handle(exchange(t.handle, nullptr)) {}
+        TLE7230Task& operator=(TLE7230Task&& t) noexcept
+        {
+            if(this != &t)
+            {
+                if(handle) handle.destroy();
+                handle = exchange(t.handle, nullptr);
+            }
+            return *this;
+        }
+        ~TLE7230Task() {if(handle) handle.destroy();}
+
+        // co_await task: runs it now, resumes here when it ends and rethrows what it threw
+        bool await_ready() const noexcept {return !handle || handle.done();}
+        coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept
+        {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+        void await_resume()
+        {
+            if(handle && handle.promise().error) rethrow_exception(handle.promise().error);
+        }
+
+    private:
+        friend class TLE7230Executor;
+        coroutine_handle<promise_type> handle;
+
+        explicit TLE7230Task(coroutine_handle<promise_type> h) : handle(h) {}
+};
+
+class TLE7230Executor
+{
+    public:
+        using Clock = chrono::steady_clock;
+
+        struct Stats
+        {
+            unsigned long long iterations = 0;  //passes of the loop that resumed something
+            unsigned long long batches = 0;     //execute() calls
+            unsigned long long operations = 0;  //operations in them; operations/batches is what batching bought
+        };
+
+    private:
+        //one awaited operation, parked until the batch it goes out in comes back
+        struct Waiter
+        {
+            TLE7230::Batch::Op op;
+            coroutine_handle<> handle;
+            TLE7230::BatchResult result;
+            exception_ptr error;
+        };
+
+    public:
+        // Awaitable operation: co_await gives its TLE7230::BatchResult, or throws runtime_error if the batch failed
+        class Operation
+        {
+            public:
+                bool await_ready() const noexcept {return false;}
+                void await_suspend(coroutine_handle<> h)
+                {
+                    waiter.handle = h;
+                    executor->pending.push_back(&waiter);
+                }
+                TLE7230::BatchResult await_resume()
+                {
+                    if(waiter.error) rethrow_exception(waiter.error);
+                    return waiter.result;
+                }
+
+            private:
+                friend class TLE7230Executor;
+                TLE7230Executor* executor;
+                Waiter waiter;
+
+                Operation(TLE7230Executor* executor, TLE7230::Batch::Op op) : executor(executor), waiter{op, nullptr, {}, nullptr} {}
+        };
+
+        // Awaitable delay, see sleep()
+        class Delay
+        {
+            public:
+                bool await_ready() const noexcept {return when <= Clock::now();}
+                void await_suspend(coroutine_handle<> h) {executor->timers.push(Timer{when, executor->timerSequence++, h});}
+                void await_resume() noexcept {}
+
+            private:
+                friend class TLE7230Executor;
+                TLE7230Executor* executor;
+                Clock::time_point when;
+
+                Delay(TLE7230Executor* executor, Clock::time_point when) : executor(executor), when(when) {}
+        };
+
+        // @param driver the executor runs its operations from run()'s thread; other threads may still use the driver,
+        //        they take turns on its bus lock @param maxBatch most operations in one execute()
+        TLE7230Executor(TLE7230& driver, size_t maxBatch = 64) : driver(driver), maxBatch(maxBatch) {}
+
+        TLE7230Executor(const TLE7230Executor&) = delete;
+        TLE7230Executor& operator=(const TLE7230Executor&) = delete;
+
+        // Starts task on the next iteration of run(); the executor owns it from now on
+        void spawn(TLE7230Task task)
+        {
+            if(!task.handle) return;
+            ready.push_back(task.handle);
+            tasks.push_back(move(task));
+        }
+
+        // Runs until every spawned task has finished (tasks spawned while running included)
+        // @throws what the first task to fail threw, once the others have finished
+        void run()
+        {
+            exception_ptr error;
+            vector<coroutine_handle<>> resuming;
+            while(!tasks.empty())
+            {
+                //due timers join the runnable coroutines
+                for(Clock::time_point now = Clock::now(); !timers.empty() && timers.top().when <= now; timers.pop())
+                    ready.push_back(timers.top().handle);
+
+                if(!ready.empty())
+                {
+                    ++stats.iterations;
+                    resuming.swap(ready);
+                    for(coroutine_handle<> h : resuming) h.resume();
+                    resuming.clear();
+                }
+                //every runnable coroutine is suspended now: what they wait on goes out together
+                if(!pending.empty()) __flush();
+
+                for(size_t i = 0; i < tasks.size();)
+                {
+                    if(!tasks[i].handle.done()) {++i; continue;}
+                    if(!error) error = tasks[i].handle.promise().error;
+                    tasks.erase(tasks.begin() + i);
+                }
+                if(ready.empty() && !tasks.empty())
+                {
+                    //nothing runnable: a coroutine suspended on something the executor doesn't drive would hang here
+                    if(timers.empty()) throw runtime_error("tasks waiting on nothing; TLE7230Executor::run()");
+                    this_thread::sleep_until(timers.top().when);
+                }
+            }
+            if(error) rethrow_exception(error);
+        }
+
+        // co_await ex.x(...) forms of TLE7230's operations: same numbering, checked here (the throw is in the caller)
+        // @throws runtime_error on an invalid device/relay/address
+        Operation writeRegister(int device, char addr, char data) {return __op(TLE7230::Batch::WRITE, device, __addr(addr), data);}
+        Operation turnRelayOn(int device, int relay)  {return __op(TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, __relayBit(relay));}
+        Operation turnRelayOff(int device, int relay) {return __op(TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, __relayBit(relay));}
+        Operation turnRelaysOn(int device, bitset<8> relays)  {return __op(TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, relays.to_ulong());}
+        Operation turnRelaysOff(int device, bitset<8> relays) {return __op(TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, relays.to_ulong());}
+        Operation readRegister(int device, char addr) {return __op(TLE7230::Batch::READ, device, __addr(addr), 0);}
+        Operation resetRegisters(int device) {return __op(TLE7230::Batch::RESET, device, 0, 0);}
+        Operation updateDiagStatus(int device) {return __op(TLE7230::Batch::DIAGNOSIS, device, 0, 0);}
+
+        // co_await ex.sleep(d): resumes after d, other coroutines run meanwhile
+        Delay sleep(Clock::duration d) {return Delay(this, Clock::now() + d);}
+        Delay sleepUntil(Clock::time_point when) {return Delay(this, when);}
+
+        TLE7230& getDriver() {return driver;}
+        Stats getStats() {return stats;}
+
+    private:
+        struct Timer
+        {
+            Clock::time_point when;
+            unsigned long long sequence; //same time: in the order they were set
+            coroutine_handle<> handle;
+            bool operator>(const Timer& t) const {return when != t.when ? when > t.when : sequence > t.sequence;}
+        };
+
+        TLE7230& driver;
+        size_t maxBatch;
+        vector<TLE7230Task> tasks;                       //spawned, not finished
+        vector<coroutine_handle<>> ready;                //to resume on the next iteration
+        vector<Waiter*> pending;                         //suspended on an operation, in the order they were issued
+        priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+        unsigned long long timerSequence = 0;
+        Stats stats;
+
+        Operation __op(TLE7230::Batch::Kind kind, int device, char addr, char data)
+        {
+            if(device < 1 || device > driver.getDeviceCount()) throw runtime_error("invalid device; TLE7230Executor");
+            return Operation(this, TLE7230::Batch::Op{kind, device, addr, data});
+        }
+
+        static char __addr(char addr)
+        {
+            if(addr < 1 || addr > 8) throw runtime_error("invalid address; TLE7230Executor");
+            return addr;
+        }
+
+        static char __relayBit(int relay)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Executor");
+            return 1 << (relay-1);
+        }
+
+        //runs the pending operations as few batches as the ordering rule allows; their coroutines become ready
+        void __flush()
+        {
+            TLE7230::Batch batch;
+            vector<Waiter*> run;
+            for(Waiter* w : pending)
+            {
+                if(batch.mustFollow(w->op) || batch.size() >= maxBatch) __execute(batch, run);
+                batch.add(w->op);
+                run.push_back(w);
+            }
+            __execute(batch, run);
+            pending.clear();
+        }
+
+        void __execute(TLE7230::Batch& batch, vector<Waiter*>& run)
+        {
+            if(batch.empty()) return;
+            vector<TLE7230::BatchResult> results;
+            exception_ptr error;
+            try {results = driver.execute(batch);}
+            catch(...) {error = current_exception();}
+            ++stats.batches;
+            stats.operations += run.size();
+            for(size_t i = 0; i < run.size(); ++i)
+            {
+                if(error) run[i]->error = error;
+                else run[i]->result = results[i];
+                ready.push_back(run[i]->handle);
+            }
+            batch.clear();
+            run.clear();
+        }
+};
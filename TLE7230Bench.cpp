@@ -0,0 +1,180 @@
+/*****TLE7230Bench: throughput/latency benchmark for the TLE7230 driver ******************************************
+Runs a fixed workload through the driver and prints ops/s, time per op, SPI transfers per op and the driver's own
+per-operation latency percentiles (TLE7230_STATS).
+
+*****TO BUILD (simulated chips, runs anywhere):
+g++ -O2 -pthread -DTLE7230_STATS -DTLE7230_NO_PIGPIO TLE7230Bench.cpp -o TLE7230Bench -std=c++20
+
+*****TO BUILD FOR THE PI (adds the pigpio and spidev transports):
+g++ -O2 -pthread -DTLE7230_STATS TLE7230Bench.cpp -o TLE7230Bench -lpigpiod_if2 -lrt -std=c++20
+
+*****TO RUN:
+./TLE7230Bench [sim|pigpio|spidev|replay:trace] [toggle|sweep|dump|diag|static|all] [iterations] [devices] [sim transfer delay us] [record trace]
+
+e.g. "./TLE7230Bench pigpio toggle 10000" against "./TLE7230Bench spidev toggle 10000" compares the pigpiod socket
+with direct spidev ioctls on the same wiring, and "toggle" against "static" compares TLE7230 with TLE7230Static.
+Any device count but 2 selects daisy-chain mode (0: a chain of 2)
+A trace recorded on the Pi (last argument) replays on any machine with the same workload and devices, e.g.
+"./TLE7230Bench pigpio dump 1000 2 0 dump.trace" then "./TLE7230Bench replay:dump.trace dump 1000": the driver's CPU cost
+on the real traffic, without the bus (see TLE7230Trace.h)
+*/
+
+#include "TLE7230.h"
+#include "TLE7230Sim.h"
+#include "TLE7230Static.h"
+#include "TLE7230Trace.h"
+#ifndef TLE7230_NO_PIGPIO
+#include "TLE7230Spidev.h"
+#endif
+#include <cstring>
+
+//relay toggle storm: every relay on every device on then off, one call each
+static void toggle(TLE7230& t, int iterations)
+{
+    for(int i = 0; i < iterations; ++i)
+    {
+        int device = i % t.getDeviceCount() + 1;
+        int relay = i / t.getDeviceCount() % 8 + 1;
+        if(i / (8*t.getDeviceCount()) % 2 == 0) t.turnRelayOn(device, relay);
+        else t.turnRelayOff(device, relay);
+    }
+}
+
+//full register sweep: readRegisters(addr) for every register, bypassing the cache
+static void sweep(TLE7230& t, int iterations)
+{
+    for(int i = 0; i < iterations; ++i)
+    {
+        t.invalidateRegisterCache();
+        t.readRegisters(char(i % 8 + 1));
+    }
+}
+
+//full state dump: readAllRegisters(), every register of every device pipelined
+static void dump(TLE7230& t, int iterations)
+{
+    for(int i = 0; i < iterations; ++i) t.readAllRegisters();
+}
+
+//diagnosis polling, as the poller would do it
+static void diag(TLE7230& t, int iterations)
+{
+    for(int i = 0; i < iterations; ++i) t.updateDiagStatus();
+}
+
+//the toggle storm again through TLE7230Static: same frames, compile-time topology
+template <bool DaisyChain, int Devices> static void toggleStatic(TLE7230::Transport& io, int iterations)
+{
+    TLE7230Static<DaisyChain, Devices> t(io);
+    auto start = chrono::steady_clock::now();
+    for(int i = 0; i < iterations; ++i)
+    {
+        int device = i % Devices + 1;
+        int relay = i / Devices % 8 + 1;
+        if(i / (8*Devices) % 2 == 0) t.turnRelayOn(device, relay);
+        else t.turnRelayOff(device, relay);
+    }
+    double ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    printf("\nrelay toggle storm (TLE7230Static): %d ops in %.3f ms, %.0f ops/s, %.2f us/op\n", iterations, ns/1e6,
+           iterations/(ns/1e9), ns/1e3/iterations);
+}
+
+static void run(TLE7230& t, const char* name, void (*workload)(TLE7230&, int), int iterations)
+{
+    t.resetStats();
+    auto start = chrono::steady_clock::now();
+    workload(t, iterations);
+    double ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    unsigned long long transfers = 0;
+    for(const TLE7230::OpStats& s : t.getStats()) transfers += s.transfers;
+    printf("\n%s: %d ops in %.3f ms, %.0f ops/s, %.2f us/op", name, iterations, ns/1e6, iterations/(ns/1e9),
+           ns/1e3/iterations);
+#ifdef TLE7230_STATS
+    printf(", %.2f transfers/op\n", double(transfers)/iterations);
+    t.printStats();
+#else
+    printf("\n");
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+    const char* transport = argc > 1 ? argv[1] : "sim";
+    const char* workload = argc > 2 ? argv[2] : "all";
+    int iterations = argc > 3 ? atoi(argv[3]) : 10000;
+    int devices = argc > 4 ? atoi(argv[4]) : 2;
+    int delayUs = argc > 5 ? atoi(argv[5]) : 0;
+    const char* recordPath = argc > 6 ? argv[6] : nullptr;
+    bool daisyChain = devices != 2;
+    if(!devices) devices = 2;
+
+#ifndef TLE7230_STATS
+    printf("built without -DTLE7230_STATS: only totals are printed\n");
+#endif
+
+    try
+    {
+        unique_ptr<TLE7230::Transport> gpio;   //spidev's RSTn/FLTn, must outlive io
+        unique_ptr<TLE7230::Transport> io;
+        TLE7230Replay* replay = nullptr;
+        if(!strncmp(transport, "replay:", 7)) io.reset(replay = new TLE7230Replay(transport + 7));
+        else if(!strcmp(transport, "sim"))
+        {
+            TLE7230Sim* sim = new TLE7230Sim(daisyChain, devices);
+            sim->setTransferDelay(chrono::microseconds(delayUs));
+            io.reset(sim);
+        }
+#ifndef TLE7230_NO_PIGPIO
+        else if(!strcmp(transport, "pigpio")) io.reset(new TLE7230::PigpioTransport());
+        else if(!strcmp(transport, "spidev"))
+        {
+            gpio.reset(new TLE7230::PigpioTransport());
+            io.reset(new SpidevTransport(0, gpio.get()));
+        }
+#endif
+        else
+        {
+            printf("unknown transport %s\n", transport);
+            return 1;
+        }
+
+        unique_ptr<TLE7230Recorder> recorder;
+        if(recordPath) recorder.reset(new TLE7230Recorder(*io, recordPath));
+        TLE7230::Transport& bus = recorder ? *recorder : *io;
+
+        bool all = !strcmp(workload, "all");
+        {
+            TLE7230 relays(bus, daisyChain, 4194304, devices);
+            if(recorder) recorder->attach(relays);
+            if(replay) replay->attach(relays);
+            if(all || !strcmp(workload, "toggle")) run(relays, "relay toggle storm", toggle, iterations);
+            if(all || !strcmp(workload, "sweep")) run(relays, "register sweep", sweep, iterations);
+            if(all || !strcmp(workload, "dump")) run(relays, "register dump", dump, iterations);
+            if(all || !strcmp(workload, "diag")) run(relays, "diagnosis polling", diag, iterations);
+            if(recorder) recorder->attach(nullptr);
+            if(replay) replay->attach(nullptr);
+        }
+        if(recorder) printf("\nrecorded %llu frames to %s\n", recorder->getFrameCount(), recordPath);
+        if(replay)
+        {
+            TLE7230Replay::Stats r = replay->getStats();
+            printf("\nreplayed %llu frames: %llu differed from the trace, %llu past its end, %llu left over\n", r.frames,
+                   r.mismatches, r.beyond, r.remaining);
+        }
+        //the static driver needs its topology when compiling: the common ones are instantiated here
+        if(all || !strcmp(workload, "static"))
+        {
+            if(!daisyChain) toggleStatic<false, 2>(bus, iterations);
+            else if(devices == 1) toggleStatic<true, 1>(bus, iterations);
+            else if(devices == 4) toggleStatic<true, 4>(bus, iterations);
+            else if(devices == 8) toggleStatic<true, 8>(bus, iterations);
+            else printf("\nTLE7230Static: no instance for a chain of %d in this benchmark\n", devices);
+        }
+    }
+    catch(const exception& e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
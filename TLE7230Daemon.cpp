@@ -0,0 +1,72 @@
+/*****TLE7230Daemon: owns the TLE7230s and serves them to local processes (TLE7230Service.h) ***********************
+Clients use TLE7230Client: commands over the Unix socket, diagnosis and relay outputs straight from shared memory.
+
+*****TO BUILD (simulated chips, runs anywhere):
+g++ -O2 -pthread -DTLE7230_NO_PIGPIO TLE7230Daemon.cpp -o TLE7230Daemon -lrt -std=c++20
+
+*****TO BUILD FOR THE PI:
+g++ -O2 -pthread TLE7230Daemon.cpp -o TLE7230Daemon -lpigpiod_if2 -lrt -std=c++20
+
+*****TO RUN:
+./TLE7230Daemon [sim|pigpio] [socket path] [shm name] [devices] [diagnosis poll ms] [cold|warm]
+
+Defaults: pigpio (sim without pigpio), /tmp/tle7230.sock, /tle7230, 2 devices, 10 ms, cold. Any device count but 2 selects
+daisy-chain mode. warm attaches to the chips as a previous run left them (TLE7230::WARM), so a restart keeps the relays. Runs until SIGINT/SIGTERM, then removes the socket and the shared-memory segment.
+*/
+
+#include "TLE7230Service.h"
+#include "TLE7230Sim.h"
+#include <signal.h>
+
+int main(int argc, char* argv[])
+{
+#ifndef TLE7230_NO_PIGPIO
+    const char* transport = argc > 1 ? argv[1] : "pigpio";
+#else
+    const char* transport = argc > 1 ? argv[1] : "sim";
+#endif
+    string socketPath = argc > 2 ? argv[2] : "/tmp/tle7230.sock";
+    string shmName = argc > 3 ? argv[3] : "/tle7230";
+    int devices = argc > 4 ? atoi(argv[4]) : 2;
+    int pollMs = argc > 5 ? atoi(argv[5]) : 10;
+    TLE7230::Start start = argc > 6 && !strcmp(argv[6], "warm") ? TLE7230::WARM : TLE7230::COLD;
+    bool daisyChain = devices != 2;
+
+    //signals are taken with sigwait() below, so every thread started from here on has them blocked
+    sigset_t stop;
+    sigemptyset(&stop);
+    sigaddset(&stop, SIGINT);
+    sigaddset(&stop, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop, nullptr);
+
+    try
+    {
+        unique_ptr<TLE7230::Transport> io;
+        if(!strcmp(transport, "sim")) io.reset(new TLE7230Sim(daisyChain, devices));
+#ifndef TLE7230_NO_PIGPIO
+        else if(!strcmp(transport, "pigpio")) io.reset(new TLE7230::PigpioTransport());
+#endif
+        else
+        {
+            printf("unknown transport %s\n", transport);
+            return 1;
+        }
+
+        TLE7230 relays(*io, daisyChain, 4194304, devices, TLE7230::Pins(), start);
+        if(pollMs > 0) relays.startDiagPoller(chrono::milliseconds(pollMs));
+        TLE7230Server server(relays, socketPath, shmName, chrono::milliseconds(pollMs > 0 ? pollMs : 10));
+        printf("serving %d device(s) on %s, shared memory %s\n", devices, socketPath.c_str(), shmName.c_str());
+        fflush(stdout);
+
+        int signal;
+        sigwait(&stop, &signal);
+        TLE7230Server::Stats s = server.getStats();
+        printf("stopping: %llu requests, %llu operations, %llu refused\n", s.requests, s.operations, s.refused);
+    }
+    catch(const exception& e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
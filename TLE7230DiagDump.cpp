@@ -0,0 +1,74 @@
+/*****TLE7230DiagDump: prints a diagnosis history file written by TLE7230::enableDiagHistory() ********************
+Runs anywhere (no pigpio needed), e.g. on a file copied off the Pi after a fault or a crash.
+
+*****TO BUILD:
+g++ -DTLE7230_NO_PIGPIO TLE7230DiagDump.cpp -o TLE7230DiagDump -std=c++20
+
+*****TO RUN:
+./TLE7230DiagDump [file] [-c]
+
+One line per diagnosis word, oldest first: wall-clock time, device, the command it answered, the driver operation that
+sent the frame, and each relay 1 to 8 as . (ok) V (overload) O (open load) G (short to ground).
+-c prints only records where a device's word differs from its previous one
+*/
+
+#include "TLE7230.h"
+#include <ctime>
+
+static const char* commandName(uint8_t cmd)
+{
+    switch(cmd & 0b11000000)
+    {
+        case 0b00000000: return "DIAG";
+        case 0b01000000: return "READ";
+        case 0b10000000: return "RESET";
+        default:         return "WRITE";
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s file [-c]\n", argv[0]);
+        return 1;
+    }
+    bool changesOnly = argc > 2 && !strcmp(argv[2], "-c");
+    TLE7230::DiagLogHeader header;
+    vector<TLE7230::DiagRecord> records;
+    try
+    {
+        records = TLE7230::readDiagHistoryFile(argv[1], &header);
+    }
+    catch(const exception& e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    printf("%s: capacity %llu, %zu records\n", argv[1], (unsigned long long)header.capacity, records.size());
+
+    map<int, uint16_t> last;
+    for(const TLE7230::DiagRecord& r : records)
+    {
+        auto it = last.find(r.device);
+        bool changed = it == last.end() || it->second != r.diag;
+        last[r.device] = r.diag;
+        if(changesOnly && !changed) continue;
+
+        int64_t wall = r.time;
+        time_t seconds = wall / 1000000000;
+        tm local;
+        localtime_r(&seconds, &local);
+        char when[32];
+        strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &local);
+
+        char relays[9];
+        for(int relay = 1; relay <= 8; ++relay) relays[relay-1] = ".VOG"[3 - (r.diag >> (relay*2-2) & 0b11)];
+        relays[8] = 0;
+
+        const char* op = r.op < TLE7230::OP_COUNT ? TLE7230::OPERATION_NAMES[r.op] : "?";
+        printf("%s.%06lld  device %d  %-5s %d  %-16s %s%s\n", when, (long long)(wall % 1000000000 / 1000), r.device,
+               commandName(r.command), r.command & 0b00111111, op, relays, changed ? "" : "  (same)");
+    }
+    return 0;
+}
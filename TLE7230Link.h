@@ -0,0 +1,283 @@
+/*****TLE7230Link: SPI clock calibration and a runtime link-integrity monitor ****************************************
+How fast SCLK can go depends on the cabling of each cabinet; too fast gives silent bit errors in diagnosis words and
+register reads. TLE7230Link::calibrate() finds the rate by measurement:
+
+    at the current (trusted) rate: save every writable register (getProfile()) and a reference diagnosis
+    every candidate rate, slowest first, until one fails:
+        write/readback patterns (0x55, 0xAA, 0x00, 0xFF, walking ones, shifted per device) on a scratch register
+        back-to-back diagnosis frames, each of which must match the reference
+    pick the fastest passing rate within the margin (default 80%) of the fastest one that passed
+    at that rate: put every register back as it was saved (apply(), read first and verified)
+
+    TLE7230Link::Calibration c = TLE7230Link::calibrate(relays);
+    printf("%d Hz (fastest clean %d Hz)\n", c.baud, c.fastest);
+
+The scratch register defaults to SLE (slew rate: only the switching edges change while the test runs). Writes at a
+rate that turns out to be bad can be corrupted like reads, and the restore is what fixes them: calibrate with the
+loads in a safe state, and with nothing else using the driver (diagnosis must stay steady, the registers unwritten).
+
+TLE7230LinkMonitor keeps checking while running: every tick it rewrites the scratch register of every device with the
+value it already holds and reads it back (one Batch, harmless). Mismatches are counted; too many within the window
+steps the clock down to the next slower rate, drops the register cache (reads made at the bad rate may be in it)
+and tells the callback, so the application can re-apply its configuration.
+
+    TLE7230LinkMonitor monitor(relays, TLE7230LinkMonitor::Policy(), [](int from, int to){ ... log, re-apply ... });
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <deque>
+
+namespace TLE7230Link
+{
+    struct Options
+    {
+        vector<int> rates = {250000, 500000, 1000000, 2000000, 3000000, 4000000, 5000000}; //Hz, slowest first
+        char addr = TLE7230::SLE; //scratch register, written with the patterns: MAP to SLE, never CTL (the outputs)
+        int rounds = 4;           //passes over the patterns per rate
+        int diagFrames = 16;      //diagnosis frames compared per rate
+        double margin = 0.8;      //pick the fastest passing rate at most margin * the fastest one that passed
+    };
+
+    struct RateResult
+    {
+        int baud;
+        int readbacks = 0;        //registers written and read back
+        int readbackErrors = 0;   //read back different from what was written (or the transfer failed)
+        int diagFrames = 0;
+        int diagErrors = 0;       //diagnosis word different from the reference
+        bool ok() const {return readbackErrors == 0 && diagErrors == 0;}
+    };
+
+    struct Calibration
+    {
+        int baud = 0;                  //chosen, and set on the driver
+        int fastest = 0;               //fastest rate that passed
+        vector<RateResult> rates;      //every rate tried, slowest first (stops at the first failure)
+        TLE7230::ApplyResult restore;  //putting the registers back at the chosen rate
+    };
+
+    // One rate: setBaud(baud), then the patterns and diagnosis checks. The scratch register is left with the last
+    // pattern written; calibrate() restores it
+    // @param reference diagnosis word of every device, read at a trusted rate @throws runtime_error if baud can't be set
+    inline RateResult testRate(TLE7230& driver, int baud, const Options& options, const vector<bitset<16>>& reference)
+    {
+        static constexpr unsigned char PATTERNS[] = {0x55, 0xAA, 0x00, 0xFF, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
+        constexpr int count = sizeof PATTERNS;
+        int devices = driver.getDeviceCount();
+        RateResult r{baud};
+        driver.setBaud(baud);
+
+        TLE7230::Batch batch;
+        vector<pair<size_t, unsigned char>> checks; //index of the readback, value written
+        for(int round = 0; round < options.rounds; ++round)
+            for(int p = 0; p < count; ++p)
+            {
+                //neighbours in a chain get different patterns, so a word shifted by one device shows up
+                batch.clear();
+                checks.clear();
+                for(int d = 1; d <= devices; ++d)
+                {
+                    unsigned char want = PATTERNS[(p + d + round) % count];
+                    batch.writeRegister(d, options.addr, want);
+                    checks.emplace_back(batch.readRegister(d, options.addr), want);
+                }
+                vector<TLE7230::BatchResult> done;
+                try {done = driver.execute(batch);}
+                catch(const runtime_error&) {}
+                for(auto& [i, want] : checks)
+                {
+                    ++r.readbacks;
+                    if(done.empty() || done[i].status < 0 || done[i].value != want) ++r.readbackErrors;
+                }
+            }
+
+        //the first diagnosis frame answers the last read: only the ones after it carry diagnosis
+        if(driver.updateDiagStatus() < 0) ++r.diagErrors;
+        for(int f = 0; f < options.diagFrames; ++f)
+        {
+            ++r.diagFrames;
+            if(driver.updateDiagStatus() < 0) {++r.diagErrors; continue;}
+            for(int d = 1; d <= devices; ++d)
+                if(driver.getDiagStatus(d) != reference[d-1]) {++r.diagErrors; break;}
+        }
+        return r;
+    }
+
+    // Steps through options.rates and leaves the driver at the chosen one, with its registers as they were
+    // @throws runtime_error if no rate passes (the driver is put back at its old rate and restored there), options are
+    //         invalid or a transfer at the old rate fails
+    inline Calibration calibrate(TLE7230& driver, const Options& options = Options())
+    {
+        if(options.rates.empty() || !is_sorted(options.rates.begin(), options.rates.end()) || options.rates.front() <= 0
+           || options.addr < TLE7230::MAP || options.addr > TLE7230::SLE
+           || options.margin <= 0 || options.margin > 1)
+            throw runtime_error("invalid options; TLE7230Link::calibrate()");
+        int devices = driver.getDeviceCount();
+        int trusted = driver.getBaud();
+
+        //everything to put back, and what the diagnosis should read, taken at the rate in use
+        driver.invalidateRegisterCache();
+        TLE7230::Profile saved = driver.getProfile();
+        vector<bitset<16>> reference(devices);
+        for(int i = 0; i < 2; ++i)
+            if(driver.updateDiagStatus() < 0) throw runtime_error("spi communication failed; TLE7230Link::calibrate()");
+        for(int d = 1; d <= devices; ++d) reference[d-1] = driver.getDiagStatus(d);
+
+        Calibration c;
+        for(int baud : options.rates)
+        {
+            c.rates.push_back(testRate(driver, baud, options, reference));
+            if(!c.rates.back().ok()) break;
+            c.fastest = baud;
+        }
+        if(c.fastest)
+        {
+            for(const RateResult& r : c.rates)
+                if(r.ok() && r.baud <= options.margin * c.fastest) c.baud = r.baud;
+            if(!c.baud) c.baud = c.rates.front().baud; //none that slow: the slowest, which passed
+        }
+        driver.setBaud(c.baud ? c.baud : trusted);
+        driver.invalidateRegisterCache(); //holds reads made at the failed rate
+        c.restore = driver.apply(saved, true);
+        if(!c.baud) throw runtime_error("no SPI rate passed; TLE7230Link::calibrate()");
+        return c;
+    }
+}
+
+class TLE7230LinkMonitor
+{
+    public:
+        using Clock = chrono::steady_clock;
+        using StepDown = function<void(int fromBaud, int toBaud)>;
+
+        struct Policy
+        {
+            Clock::duration tick = chrono::seconds(1);     //how often the scratch register is checked
+            char addr = TLE7230::SLE;                      //scratch register, MAP to SLE: rewritten as it is, read back
+            int errors = 2;                                //mismatches within the window that step the clock down
+            Clock::duration window = chrono::seconds(60);
+            vector<int> rates = TLE7230Link::Options().rates; //steps to the next slower of these, slowest first
+        };
+
+        struct Stats
+        {
+            unsigned long long probes = 0;      //registers rewritten and read back
+            unsigned long long mismatches = 0;  //read back different (or the transfer failed)
+            unsigned long long stepDowns = 0;
+            int baud = 0;                       //current SCLK
+        };
+
+    private:
+        TLE7230& driver;
+        Policy policy;
+        StepDown stepDown;
+        int devices;
+        vector<unsigned char> expected; //policy.addr of every device, read when the monitor started
+        mutex lock;
+        condition_variable wake;
+        bool run = true;
+        Stats stats;
+        deque<Clock::time_point> recent; //mismatches within the window
+        thread worker;
+
+        //one tick: rewrite and read back, count, step down if the window has too many
+        void __tick(unique_lock<mutex>& g)
+        {
+            //always the value found at the start: a read garbled by the link mustn't be written back
+            g.unlock();
+            TLE7230::Batch batch;
+            vector<pair<size_t, unsigned char>> checks;
+            int mismatches = 0;
+            try
+            {
+                for(int d = 1; d <= devices; ++d)
+                {
+                    batch.writeRegister(d, policy.addr, expected[d-1]);
+                    checks.emplace_back(batch.readRegister(d, policy.addr), expected[d-1]);
+                }
+                vector<TLE7230::BatchResult> done = driver.execute(batch);
+                for(auto& [i, want] : checks) mismatches += done[i].status < 0 || done[i].value != want;
+            }
+            catch(const runtime_error&) {mismatches = max<int>(1, checks.size());}
+            g.lock();
+
+            Clock::time_point now = Clock::now();
+            stats.probes += devices;
+            stats.mismatches += mismatches;
+            for(int i = 0; i < mismatches; ++i) recent.push_back(now);
+            while(!recent.empty() && now - recent.front() > policy.window) recent.pop_front();
+            if((int)recent.size() < policy.errors) return;
+            recent.clear();
+
+            int from = driver.getBaud(), to = 0;
+            for(int r : policy.rates) if(r < from) to = r;
+            if(!to) return; //already at the slowest: keep counting
+            g.unlock();
+            try
+            {
+                driver.setBaud(to);
+                driver.invalidateRegisterCache();
+            }
+            catch(const runtime_error&) {}
+            if(stepDown) stepDown(from, driver.getBaud());
+            g.lock();
+            ++stats.stepDowns;
+        }
+
+        void __loop()
+        {
+            unique_lock<mutex> g(lock);
+            Clock::time_point next = Clock::now();
+            while(run)
+            {
+                next += policy.tick;
+                wake.wait_until(g, next, [this]{return !run;});
+                if(!run) break;
+                __tick(g);
+                auto now = Clock::now();
+                if(next < now - policy.tick) next = now; //fell behind, don't burst
+            }
+        }
+
+    public:
+        // @param driver relays to watch, not owned; nothing else may write policy.addr meanwhile, and the link should be
+        //        good now (its value is read here) @param policy @param stepDown called (on the monitor's thread) after
+        //        the clock was stepped down
+        // @throws runtime_error on an invalid policy or if policy.addr can't be read
+        TLE7230LinkMonitor(TLE7230& driver, Policy policy, StepDown stepDown = nullptr)
+        : driver(driver), policy(move(policy)), stepDown(move(stepDown)), devices(driver.getDeviceCount())
+        {
+            const Policy& p = this->policy;
+            if(p.tick <= Clock::duration::zero() || p.errors < 1 || p.addr < TLE7230::MAP || p.addr > TLE7230::SLE
+               || !is_sorted(p.rates.begin(), p.rates.end()))
+                throw runtime_error("invalid policy; TLE7230LinkMonitor()");
+            TLE7230::RegisterSet found = driver.readRegisterSet({p.addr});
+            for(int d = 1; d <= devices; ++d) expected.push_back(found.get(d, p.addr));
+            worker = thread(&TLE7230LinkMonitor::__loop, this);
+        }
+
+        // default Policy, no callback (see getStats())
+        explicit TLE7230LinkMonitor(TLE7230& driver) : TLE7230LinkMonitor(driver, Policy()) {}
+
+        ~TLE7230LinkMonitor()
+        {
+            {
+                lock_guard<mutex> g(lock);
+                run = false;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+        Stats getStats()
+        {
+            lock_guard<mutex> g(lock);
+            Stats s = stats;
+            s.baud = driver.getBaud();
+            return s;
+        }
+
+        const Policy& getPolicy() const {return policy;}
+};
@@ -0,0 +1,191 @@
+/*****TLE7230Manager: several TLE7230 boards on several SPI buses, driven in parallel ******************************
+Each board is a TLE7230 (one chip-select pair, or one daisy chain) with its own SPI bus, chip-selects and FLTn/RSTn GPIOs.
+Boards on the same bus share one TLE7230Worker thread; boards on different buses get different workers, so transfers
+on independent buses overlap and aggregate throughput grows with the number of buses instead of queueing on one lock.
+
+    TLE7230Manager::Board main, aux, bb;
+    aux.bus.kind = TLE7230SpiBus::AUX;           aux.bus.cs = {0, 1};
+    aux.pins = {5, 6, 13};                         //FLTn1, FLTn2, RSTn
+    bb.bus.kind = TLE7230SpiBus::BITBANG;        bb.bus.cs = {22, 23};
+    bb.bus.miso = 24; bb.bus.mosi = 25; bb.bus.sclk = 26; bb.baud = 250000;
+    bb.pins = {17, 27, 4};
+    TLE7230Manager rack({main, aux, bb});
+    rack.turnRelayOn(2, 1, 5);                     //board 2 (bit-banged), device 1, relay 5
+    rack.readRegister(0, 2, TLE7230::CTL).get().value;
+
+Buses are told apart by SpiBus kind (and SCLK GPIO when bit-banged); Board::group puts boards in a bus of your choosing
+and boards with their own Transport (e.g. TLE7230Sim) each get a bus unless they share the Transport. With pigpio, every
+bus opens its own pigpiod connection: pigpiod_if2 runs one command at a time per connection.
+Commands go through the bus worker (see TLE7230Worker.h for ordering); board(b) gives the driver itself for everything
+else (profiles, diagnosis history, fault interrupts ...), best not used for relay/register traffic while the worker is.
+*/
+
+#pragma once
+
+#include "TLE7230Worker.h"
+
+// One board of a TLE7230Manager, TLE7230Manager::Board
+struct TLE7230Board
+{
+    TLE7230SpiBus bus;                        //ignored when transport is set
+    TLE7230Pins pins;
+    bool daisyChain = false;
+    int devices = 2;
+    int baud = 4194304;
+    TLE7230::Transport* transport = nullptr;  //not owned; default: pigpio on bus
+    int group = -1;                           //>= 0: bus (worker) shared with the boards of the same group
+    TLE7230::Start start = TLE7230::COLD;     //WARM: attach to a running board, see TLE7230's constructor
+};
+
+class TLE7230Manager
+{
+    public:
+        using Board = TLE7230Board;
+        using Callback = TLE7230Worker::Callback;
+
+    private:
+        struct Bus
+        {
+#ifndef TLE7230_NO_PIGPIO
+            unique_ptr<TLE7230::PigpioTransport> connection; //pigpiod connection of the bus' boards
+#endif
+            vector<TLE7230*> drivers;
+        };
+
+        vector<Board> config;
+        vector<Bus> buses;
+        vector<unique_ptr<TLE7230::Transport>> transports; //per board, pigpio boards only
+        vector<unique_ptr<TLE7230>> drivers;
+        vector<pair<int, size_t>> where;                   //board -> (bus, board number within its worker)
+        vector<unique_ptr<TLE7230Worker>> workers;         //per bus; declared last so they stop before the drivers go
+
+        //(kind, id) naming a board's bus: (-1, group), (-2, transport), or (SpiBus kind, SCLK GPIO if bit-banged)
+        static pair<int, intptr_t> __busKey(const Board& b)
+        {
+            if(b.group >= 0) return {-1, b.group};
+            if(b.transport) return {-2, reinterpret_cast<intptr_t>(b.transport)};
+            return {b.bus.kind, b.bus.kind == TLE7230SpiBus::BITBANG ? b.bus.sclk : 0};
+        }
+
+        //two pigpio boards on one bus mustn't share a chip-select
+        static void __checkChipSelects(const vector<Board>& boards)
+        {
+            map<tuple<int, int, int>, size_t> used; //(kind, sclk, cs) -> board
+            for(size_t i = 0; i < boards.size(); ++i)
+            {
+                const Board& b = boards[i];
+                if(b.transport) continue;
+                int sclk = b.bus.kind == TLE7230SpiBus::BITBANG ? b.bus.sclk : 0;
+                for(int channel = 0; channel < (b.daisyChain ? 1 : 2); ++channel)
+                    if(!used.emplace(make_tuple(int(b.bus.kind), sclk, b.bus.cs[channel]), i).second)
+                        throw runtime_error("board " + to_string(i) + " reuses a chip-select; TLE7230Manager()");
+            }
+        }
+
+        size_t __check(size_t board)
+        {
+            if(board >= drivers.size()) throw runtime_error("invalid board; TLE7230Manager");
+            return board;
+        }
+
+        future<TLE7230::BatchResult> __submit(size_t board, TLE7230::Batch::Kind kind, int device, char addr, char data, Callback done)
+        {
+            auto [bus, index] = where[__check(board)];
+            return workers[bus]->submit(index, kind, device, addr, data, move(done));
+        }
+
+        static char __relayBit(int relay)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Manager");
+            return 1 << (relay-1);
+        }
+
+    public:
+        // Builds each board's transport (pigpio, one connection per bus, if none is given) and driver, started as its
+        // Board::start says (COLD: RSTn pulse, registers reset; WARM: attach as it is), then starts one worker per bus
+        // @param boards board b is boards[b] @param maxBatch per worker, see TLE7230Worker
+        // @throws runtime_error if a board can't be opened, two boards share a chip-select, or (without pigpio) a board
+        //         has no transport
+        TLE7230Manager(vector<Board> boards, size_t maxBatch = 64) : config(move(boards))
+        {
+            if(config.empty()) throw runtime_error("no boards; TLE7230Manager()");
+            __checkChipSelects(config);
+            map<pair<int, intptr_t>, int> busOf;
+            for(size_t i = 0; i < config.size(); ++i)
+            {
+                const Board& b = config[i];
+                auto [found, added] = busOf.emplace(__busKey(b), buses.size());
+                if(added) buses.emplace_back();
+                int bus = found->second;
+                TLE7230::Transport* io = b.transport;
+                if(!io)
+                {
+#ifndef TLE7230_NO_PIGPIO
+                    if(!buses[bus].connection) buses[bus].connection = make_unique<TLE7230::PigpioTransport>();
+                    transports.push_back(make_unique<TLE7230::PigpioTransport>(buses[bus].connection->handle(), b.bus));
+                    io = transports.back().get();
+#else
+                    throw runtime_error("board " + to_string(i) + " needs a transport without pigpio; TLE7230Manager()");
+#endif
+                }
+                drivers.push_back(make_unique<TLE7230>(*io, b.daisyChain, b.baud, b.devices, b.pins, b.start));
+                where.emplace_back(bus, buses[bus].drivers.size());
+                buses[bus].drivers.push_back(drivers.back().get());
+            }
+            for(Bus& bus : buses) workers.push_back(make_unique<TLE7230Worker>(bus.drivers, maxBatch));
+        }
+
+        // Runs everything already queued, then closes the boards
+        ~TLE7230Manager() = default;
+
+        // The driver of board b, for what the worker doesn't cover @throws runtime_error on an invalid board
+        TLE7230& board(size_t b) {return *drivers[__check(b)];}
+        const Board& getBoardConfig(size_t b) {return config[__check(b)];}
+        size_t getBoardCount() {return drivers.size();}
+        size_t getBusCount() {return buses.size();}
+        // @return the bus (worker) board b is on, 0 to getBusCount()-1
+        int getBus(size_t b) {return where[__check(b)].first;}
+
+        // Same as TLE7230Worker's, with the board first: a future, or with a callback an invalid future and the callback
+        // runs on the bus' worker thread. @throws runtime_error on an invalid board/device/address/relay
+        future<TLE7230::BatchResult> writeRegister(size_t board, int device, char addr, char data, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::WRITE, device, addr, data, move(done));
+        }
+        future<TLE7230::BatchResult> turnRelayOn(size_t board, int device, int relay, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, __relayBit(relay), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelayOff(size_t board, int device, int relay, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, __relayBit(relay), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelaysOn(size_t board, int device, bitset<8> relays, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, relays.to_ulong(), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelaysOff(size_t board, int device, bitset<8> relays, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, relays.to_ulong(), move(done));
+        }
+        future<TLE7230::BatchResult> readRegister(size_t board, int device, char addr, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::READ, device, addr, 0, move(done));
+        }
+        future<TLE7230::BatchResult> resetRegisters(size_t board, int device, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::RESET, device, 0, 0, move(done));
+        }
+        future<TLE7230::BatchResult> updateDiagStatus(size_t board, int device, Callback done = nullptr)
+        {
+            return __submit(board, TLE7230::Batch::DIAGNOSIS, device, 0, 0, move(done));
+        }
+
+        // @return per bus: (batches executed, commands executed), see TLE7230Worker::getStats()
+        vector<pair<unsigned long long, unsigned long long>> getStats()
+        {
+            vector<pair<unsigned long long, unsigned long long>> stats;
+            for(auto& w : workers) stats.push_back(w->getStats());
+            return stats;
+        }
+};
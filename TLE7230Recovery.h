@@ -0,0 +1,329 @@
+/*****TLE7230Recovery: automatic re-enable of channels shut off by a latching overload/overtemperature **************
+With OVL/OVT set to latching shutdown, a channel that trips stays off until its CTL bit is written 0 and then 1 again.
+This engine watches the decoded diagnosis of every channel and does that on its own:
+
+    trip seen (RELAY_CH_OVERLOAD)   -> CTL bit written 0 (clears the latch), retry scheduled after a backoff delay
+    retry due                       -> CTL bit written 1
+    fresh diagnosis after the retry -> ok: recovered.  overload again: another trip, the next delay is longer
+    more than maxRetries trips      -> the channel is left off and the alarm callback runs, until rearm()
+
+Only a channel that is switched on (shadow CTL bit) with its OVL or OVT bit set counts as tripped: without them the
+chip limits the current and keeps the channel on, and the engine leaves it alone.
+A trip counter is forgotten once the channel has stayed healthy for the cooldown window after recovering.
+Everything is done once per tick: at most one DIAGNOSIS_ONLY frame per chip-select (only when no other traffic brought
+fresh diagnosis) and one Batch holding every device's CTL change (one CTL write per device, one frame daisy-chained).
+FLTn edges (TLE7230::enableFaultInterrupts()) wake it early instead of waiting for the tick.
+
+    TLE7230Recovery::Policy policy;
+    policy.firstDelay = chrono::milliseconds(200);
+    TLE7230Recovery recovery(relays, policy, [](int device, int relay, int trips){ ... raise alarm ... });
+
+A channel under recovery is turned back on by the engine: to switch one off for good, call release() first.
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+
+class TLE7230Recovery
+{
+    public:
+        using Clock = chrono::steady_clock;
+        using Alarm = function<void(int device, int relay, int trips)>;
+
+        struct Policy
+        {
+            Clock::duration tick = chrono::milliseconds(10);     //how often diagnosis is checked and retries are sent
+            Clock::duration firstDelay = chrono::milliseconds(100); //wait before the first retry
+            double backoff = 2.0;                                 //delay multiplier for every further trip
+            Clock::duration maxDelay = chrono::seconds(10);
+            int maxRetries = 5;                                   //trips retried before giving up
+            Clock::duration cooldown = chrono::seconds(60);       //healthy this long after recovering: trip count starts over
+        };
+
+        enum State {IDLE, WAITING, RETRIED, ALARMED};
+
+        struct Stats
+        {
+            unsigned long long trips = 0;
+            unsigned long long retries = 0;
+            unsigned long long recoveries = 0;
+            unsigned long long alarms = 0;
+            unsigned long long ticks = 0;
+            unsigned long long diagFrames = 0;  //updateDiagStatus() calls the engine made
+            unsigned long long batches = 0;     //execute() calls, each at most one CTL write per device
+            chrono::nanoseconds maxRecovery{0}; //trip seen -> healthy again
+            chrono::nanoseconds meanRecovery{0};
+        };
+
+    private:
+        struct Channel
+        {
+            State state = IDLE;
+            int trips = 0;
+            Clock::time_point tripped;    //first trip of the current episode
+            Clock::time_point recovered;
+            Clock::time_point retryAt;
+            uint64_t retrySequence = 0;   //diagnosis snapshot sequence when the retry went out
+        };
+
+        TLE7230& driver;
+        Policy policy;
+        Alarm alarm;
+        int devices;
+        vector<array<Channel, 8>> channels; //channels[device-1][relay-1]
+        //what the fault subscription touches; shared so a FaultEvent dispatched just as this is destroyed stays safe
+        struct Signal
+        {
+            mutex lock;
+            condition_variable wake;
+            bool faultSeen = false;
+        };
+        shared_ptr<Signal> signal = make_shared<Signal>();
+        mutex& lock = signal->lock;
+        bool run = true;
+        int faultSubscription = -1;
+        Stats stats;
+        chrono::nanoseconds recoverySum{0};
+        TLE7230::DiagSnapshot snapshot;
+        thread worker;
+
+        Clock::duration __delay(int trips)
+        {
+            double d = chrono::duration<double>(policy.firstDelay).count();
+            for(int i = 1; i < trips; ++i) d *= policy.backoff;
+            return min(policy.maxDelay, chrono::duration_cast<Clock::duration>(chrono::duration<double>(d)));
+        }
+
+        void __checkChannel(int device, int relay)
+        {
+            if(device < 1 || device > devices) throw runtime_error("invalid device; TLE7230Recovery");
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Recovery");
+        }
+
+        //one tick's decisions, with lock held: what to clear and set. Only channels in latching (OVL/OVT bit set, CTL bit
+        //on, latching[device-1]) are treated as tripped; elsewhere the chip is limiting the current itself and the
+        //channel stays IDLE
+        void __tick(const vector<unsigned char>& latching, TLE7230::Batch& batch, vector<unsigned char>& on,
+                    vector<pair<int, int>>& alarms)
+        {
+            Clock::time_point now = Clock::now();
+            vector<unsigned char> off(devices + 1, 0);
+            on.assign(devices + 1, 0);
+            for(int d = 1; d <= devices; ++d)
+                for(int r = 1; r <= 8; ++r)
+                {
+                    Channel& c = channels[d-1][r-1];
+                    int status = snapshot.diag[d-1].to_ulong() >> (r*2-2) & 0b11;
+                    bool overload = status == TLE7230::RELAY_CH_OVERLOAD;
+                    switch(c.state)
+                    {
+                        case IDLE:
+                            if(!overload || !(latching[d-1] >> (r-1) & 1)) break;
+                            if(c.trips && now - c.recovered >= policy.cooldown) c.trips = 0;
+                            if(!c.trips) c.tripped = now;
+                            [[fallthrough]];
+                        case RETRIED:
+                            if(c.state == RETRIED && snapshot.sequence <= c.retrySequence) break; //no diagnosis since the retry yet
+                            if(c.state == RETRIED && !overload)
+                            {
+                                auto took = chrono::duration_cast<chrono::nanoseconds>(now - c.tripped);
+                                ++stats.recoveries;
+                                stats.maxRecovery = max(stats.maxRecovery, took);
+                                recoverySum += took;
+                                c.recovered = now;
+                                c.state = IDLE;
+                                break;
+                            }
+                            if(!(latching[d-1] >> (r-1) & 1)) {c.state = IDLE; break;} //OVL/OVT cleared meanwhile
+                            ++c.trips;
+                            ++stats.trips;
+                            off[d] |= 1 << (r-1); //clears the latch
+                            if(c.trips > policy.maxRetries)
+                            {
+                                c.state = ALARMED;
+                                ++stats.alarms;
+                                alarms.emplace_back(d, r);
+                            }
+                            else
+                            {
+                                c.state = WAITING;
+                                c.retryAt = now + __delay(c.trips);
+                            }
+                            break;
+                        case WAITING:
+                            if(now < c.retryAt) break;
+                            on[d] |= 1 << (r-1);
+                            c.state = RETRIED;
+                            ++stats.retries;
+                            break;
+                        case ALARMED:
+                            break;
+                    }
+                }
+
+            batch.clear();
+            for(int d = 1; d <= devices; ++d)
+            {
+                if(off[d]) batch.turnRelaysOff(d, off[d]);
+                if(on[d]) batch.turnRelaysOn(d, on[d]);
+            }
+            if(!batch.empty()) ++stats.batches;
+        }
+
+        //channels whose overload the chip latches: OVL or OVT bit set and CTL bit on, from the driver's shadow registers.
+        //Only asked for (and only read from the devices if not shadowed) when the diagnosis shows an overload somewhere
+        void __latching(vector<unsigned char>& out)
+        {
+            out.assign(devices, 0);
+            bool any = false;
+            for(int d = 1; d <= devices; ++d) any |= TLE7230::decodeDiag(snapshot.diag[d-1].to_ulong()).overload != 0;
+            if(!any) return;
+            try
+            {
+                TLE7230::Profile shadow = driver.getProfile();
+                for(int d = 1; d <= devices; ++d)
+                    out[d-1] = (shadow.get(d, TLE7230::OVL) | shadow.get(d, TLE7230::OVT)) & shadow.get(d, TLE7230::CTL);
+            }
+            catch(const exception&) {} //nothing counts as latched this tick
+        }
+
+        void __loop()
+        {
+            unique_lock<mutex> g(lock);
+            Clock::time_point next = Clock::now();
+            vector<pair<int, int>> alarms;
+            vector<unsigned char> latching, on;
+            TLE7230::Batch batch;
+            while(run)
+            {
+                next += policy.tick;
+                signal->wake.wait_until(g, next, [this]{return !run || signal->faultSeen;});
+                if(!run) break;
+                signal->faultSeen = false;
+                ++stats.ticks;
+
+                //the bus is used without lock held, so the accessors and the fault subscriber never wait on a transfer.
+                //snapshot and the scratch vectors belong to this thread
+                g.unlock();
+                //fresh diagnosis: whatever the bus brought within the tick, otherwise ask for it
+                driver.getDiagSnapshot(snapshot);
+                bool asked = Clock::now() - snapshot.time > policy.tick;
+                if(asked)
+                {
+                    try {driver.updateDiagStatus();}
+                    catch(const exception&) {}
+                    driver.getDiagSnapshot(snapshot);
+                }
+                __latching(latching);
+                g.lock();
+                if(asked) ++stats.diagFrames;
+                alarms.clear();
+                __tick(latching, batch, on, alarms);
+                if(!batch.empty())
+                {
+                    g.unlock();
+                    try {driver.execute(batch);}
+                    catch(const exception&) {} //retried on a later tick: the diagnosis won't have changed
+                    //diagnosis shifted out with these writes predates them: only what comes after counts
+                    TLE7230::DiagSnapshot after;
+                    driver.getDiagSnapshot(after);
+                    g.lock();
+                    for(int d = 1; d <= devices; ++d)
+                        for(int r = 1; r <= 8; ++r)
+                        {
+                            Channel& c = channels[d-1][r-1];
+                            if((on[d] >> (r-1) & 1) && c.state == RETRIED) c.retrySequence = after.sequence;
+                        }
+                }
+
+                if(alarm && !alarms.empty())
+                {
+                    g.unlock();
+                    for(auto& [d, r] : alarms) alarm(d, r, policy.maxRetries + 1);
+                    g.lock();
+                }
+                auto now = Clock::now();
+                if(next < now - policy.tick) next = now; //fell behind, don't burst
+            }
+        }
+
+    public:
+        // @param driver relays to watch, not owned @param policy backoff/limits @param alarm called (on the engine's
+        //        thread) when a channel is given up on
+        TLE7230Recovery(TLE7230& driver, Policy policy, Alarm alarm = nullptr)
+        : driver(driver), policy(policy), alarm(move(alarm)), devices(driver.getDeviceCount()), channels(devices)
+        {
+            if(policy.tick <= Clock::duration::zero() || policy.backoff < 1 || policy.maxRetries < 0)
+                throw runtime_error("invalid policy; TLE7230Recovery()");
+            faultSubscription = driver.subscribeFaults([signal = signal](const TLE7230::FaultEvent& e)
+            {
+                if(e.status != TLE7230::RELAY_CH_OVERLOAD) return;
+                {
+                    lock_guard<mutex> g(signal->lock);
+                    signal->faultSeen = true;
+                }
+                signal->wake.notify_one();
+            });
+            worker = thread(&TLE7230Recovery::__loop, this);
+        }
+
+        // default Policy, no alarm callback (see getState()/getStats())
+        explicit TLE7230Recovery(TLE7230& driver) : TLE7230Recovery(driver, Policy()) {}
+
+        ~TLE7230Recovery()
+        {
+            driver.unsubscribeFaults(faultSubscription);
+            {
+                lock_guard<mutex> g(lock);
+                run = false;
+            }
+            signal->wake.notify_one();
+            worker.join();
+        }
+
+        // Stops recovering a channel (e.g. before switching it off on purpose). Also clears an alarm
+        void release(int device, int relay)
+        {
+            __checkChannel(device, relay);
+            lock_guard<mutex> g(lock);
+            channels[device-1][relay-1] = Channel();
+        }
+
+        // After an alarm: forget the trips and turn the channel back on, as a retry
+        void rearm(int device, int relay)
+        {
+            __checkChannel(device, relay);
+            lock_guard<mutex> g(lock);
+            Channel& c = channels[device-1][relay-1];
+            if(c.state != ALARMED) return;
+            c.trips = 0;
+            c.state = WAITING;
+            c.retryAt = Clock::now();
+        }
+
+        State getState(int device, int relay)
+        {
+            __checkChannel(device, relay);
+            lock_guard<mutex> g(lock);
+            return channels[device-1][relay-1].state;
+        }
+
+        // @return trips in the current episode (reset by cooldown, release() and rearm())
+        int getTrips(int device, int relay)
+        {
+            __checkChannel(device, relay);
+            lock_guard<mutex> g(lock);
+            return channels[device-1][relay-1].trips;
+        }
+
+        Stats getStats()
+        {
+            lock_guard<mutex> g(lock);
+            Stats s = stats;
+            if(s.recoveries) s.meanRecovery = recoverySum / s.recoveries;
+            return s;
+        }
+
+        const Policy& getPolicy() const {return policy;}
+};
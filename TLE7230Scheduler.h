@@ -0,0 +1,275 @@
+/*****TLE7230Scheduler: timed relay changes and software PWM for a TLE7230 ****************************************
+Relay changes are queued with the time they should happen, or as repeating on/off patterns, and a scheduler thread
+carries them out. Due times are rounded up to a tick grid; everything that lands on the same tick goes out as one
+TLE7230::Batch, so it costs one CTL write per device (one frame for the whole chain when daisy-chained) however many
+relays change together.
+
+    TLE7230Scheduler sched(relays, chrono::milliseconds(1), 50);     //1 ms ticks, SCHED_FIFO priority 50
+    auto t0 = chrono::steady_clock::now();
+    for(int r = 1; r <= 8; ++r) sched.at(t0 + r*chrono::milliseconds(100), 1, r, true);  //staggered bring-up
+    sched.pwm(2, 3, chrono::seconds(2), chrono::milliseconds(500));  //heater: 25% duty on a 2 s period
+    TLE7230Scheduler::Timing t = sched.getTiming();                  //how late the changes actually went out
+
+Timing error is measured per change, from the requested time to when the frame carrying it came back from the bus.
+Real-time priority needs CAP_SYS_NICE (or root); without it the thread runs at normal priority, see isRealtime().
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <pthread.h>
+#include <set>
+
+class TLE7230Scheduler
+{
+    public:
+        using Clock = chrono::steady_clock;
+        using Id = unsigned long long;
+
+        // Achieved vs requested time of the relay changes carried out so far
+        struct Timing
+        {
+            unsigned long long changes = 0;   //relay changes carried out (a PWM edge counts once)
+            unsigned long long ticks = 0;     //batches sent
+            unsigned long long late = 0;      //changes more than one tick after their requested time
+            unsigned long long failures = 0;  //changes whose batch failed on the bus
+            chrono::nanoseconds meanError{0}; //mean of (done - requested)
+            chrono::nanoseconds maxError{0};
+        };
+
+    private:
+        struct Entry
+        {
+            Clock::time_point fire;           //due, rounded up to the tick grid: heap key
+            Clock::time_point due;            //requested
+            Id id;
+            int device;
+            unsigned char on, off;            //relay masks
+            Clock::duration period{0};        //PWM: repeats with this period, 0 = once
+            Clock::duration onTime{0};        //PWM: on for this long each period
+            unsigned long long seq = 0;       //queue order, set by __push(); a PWM's edges share its id but not this
+            bool operator>(const Entry& e) const {return fire != e.fire ? fire > e.fire : seq > e.seq;}
+        };
+
+        TLE7230& driver;
+        Clock::duration tick;
+        Clock::time_point epoch;              //tick grid origin
+        vector<Entry> heap;                   //min-heap on fire
+        set<Id> cancelled;                    //lazy deletion from heap
+        Id nextId = 1;
+        unsigned long long nextSeq = 0;
+        mutex lock;
+        condition_variable wake;
+        bool run = true;
+        atomic<bool> realtime{false};
+        thread worker;
+
+        Timing timing;
+        chrono::nanoseconds errorSum{0};
+
+        Clock::time_point __onGrid(Clock::time_point due)
+        {
+            if(due <= epoch) return epoch;
+            auto ticks = (due - epoch + tick - Clock::duration(1)) / tick;
+            return epoch + ticks*tick;
+        }
+
+        void __push(Entry e)
+        {
+            e.fire = __onGrid(e.due);
+            e.seq = nextSeq++;
+            heap.push_back(e);
+            push_heap(heap.begin(), heap.end(), greater<Entry>());
+        }
+
+        void __checkDevice(int device)
+        {
+            if(device < 1 || device > driver.getDeviceCount()) throw runtime_error("invalid device; TLE7230Scheduler");
+        }
+
+        static unsigned char __relayBit(int relay)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Scheduler");
+            return 1 << (relay-1);
+        }
+
+        Id __add(Clock::time_point due, int device, unsigned char on, unsigned char off, Clock::duration period = {}, Clock::duration onTime = {})
+        {
+            __checkDevice(device);
+            Id id;
+            {
+                lock_guard<mutex> g(lock);
+                id = nextId++;
+                __push(Entry{{}, due, id, device, on, off, period, onTime});
+            }
+            wake.notify_one(); //may be earlier than what the thread is waiting for
+            return id;
+        }
+
+        void __setRealtime(int priority)
+        {
+            if(priority <= 0) return;
+            sched_param p{};
+            p.sched_priority = priority;
+            realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &p) == 0;
+        }
+
+        void __loop(int priority)
+        {
+            __setRealtime(priority);
+            vector<Entry> due;
+            unique_lock<mutex> g(lock);
+            while(run)
+            {
+                if(heap.empty()) {wake.wait(g); continue;}
+                Clock::time_point fire = heap.front().fire;
+                if(Clock::now() < fire) {wake.wait_until(g, fire); continue;} //re-check: an earlier entry may have arrived
+
+                //everything on this tick (or missed earlier ones), in the order it was queued
+                due.clear();
+                while(!heap.empty() && heap.front().fire <= fire)
+                {
+                    pop_heap(heap.begin(), heap.end(), greater<Entry>());
+                    Entry e = heap.back();
+                    heap.pop_back();
+                    if(cancelled.erase(e.id)) continue;
+                    due.push_back(e);
+                    if(e.period != Clock::duration::zero()) //PWM: queue the next edge
+                    {
+                        Entry next = e;
+                        bool onEdge = e.on != 0;
+                        next.due = e.due + (onEdge ? e.onTime : e.period - e.onTime);
+                        swap(next.on, next.off);
+                        __push(next);
+                    }
+                }
+                sort(due.begin(), due.end(), [](const Entry& a, const Entry& b){return a.seq < b.seq;});
+                g.unlock();
+
+                //later changes to the same relay in the tick win
+                int devices = driver.getDeviceCount();
+                vector<unsigned char> on(devices + 1, 0), off(devices + 1, 0);
+                for(const Entry& e : due)
+                {
+                    on[e.device] = (on[e.device] & ~e.off) | e.on;
+                    off[e.device] = (off[e.device] & ~e.on) | e.off;
+                }
+                TLE7230::Batch batch;
+                for(int d = 1; d <= devices; ++d)
+                {
+                    if(on[d]) batch.turnRelaysOn(d, on[d]);
+                    if(off[d]) batch.turnRelaysOff(d, off[d]);
+                }
+                bool ok = true;
+                try
+                {
+                    for(const TLE7230::BatchResult& r : driver.execute(batch)) ok &= r.status >= 0;
+                }
+                catch(const exception&) {ok = false;}
+                Clock::time_point done = Clock::now();
+
+                g.lock();
+                ++timing.ticks;
+                for(const Entry& e : due)
+                {
+                    auto error = chrono::duration_cast<chrono::nanoseconds>(done - e.due);
+                    ++timing.changes;
+                    if(!ok) ++timing.failures;
+                    if(error > tick) ++timing.late;
+                    timing.maxError = max(timing.maxError, error);
+                    errorSum += error;
+                }
+            }
+        }
+
+    public:
+        // @param driver relays to switch, not owned
+        // @param tick changes are rounded up to multiples of this (from construction) and a tick's changes go out together
+        // @param priority SCHED_FIFO priority for the scheduler thread, 1 to 99; 0 = normal scheduling
+        // @throws runtime_error if tick isn't positive
+        TLE7230Scheduler(TLE7230& driver, Clock::duration tick = chrono::milliseconds(1), int priority = 0)
+        : driver(driver), tick(tick), epoch(Clock::now())
+        {
+            if(tick <= Clock::duration::zero()) throw runtime_error("tick must be positive; TLE7230Scheduler()");
+            worker = thread(&TLE7230Scheduler::__loop, this, priority);
+        }
+
+        // Stops the thread; changes still queued are dropped and the relays stay as they are
+        ~TLE7230Scheduler()
+        {
+            {
+                lock_guard<mutex> g(lock);
+                run = false;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+        // One relay change at a given time. A time in the past happens on the next tick
+        // @return id for cancel() @throws runtime_error on an invalid device/relay
+        Id at(Clock::time_point when, int device, int relay, bool on)
+        {
+            unsigned char bit = __relayBit(relay);
+            return __add(when, device, on ? bit : 0, on ? 0 : bit);
+        }
+
+        // Several relays of one device at a given time: on are switched on, off switched off (a relay in both ends up on)
+        Id at(Clock::time_point when, int device, bitset<8> on, bitset<8> off)
+        {
+            return __add(when, device, on.to_ulong(), off.to_ulong() & ~on.to_ulong());
+        }
+
+        Id after(Clock::duration delay, int device, int relay, bool on) {return at(Clock::now() + delay, device, relay, on);}
+
+        // Software PWM: relays switched on at start, off onTime later, and again every period until cancel()
+        // @param onTime tick <= onTime <= period - tick, so the two edges never share a tick
+        // @return id for cancel() @throws runtime_error
+        Id pwm(int device, bitset<8> relays, Clock::duration period, Clock::duration onTime, Clock::time_point start = Clock::now())
+        {
+            if(onTime < tick || period - onTime < tick)
+                throw runtime_error("need tick <= onTime <= period - tick; TLE7230Scheduler::pwm()");
+            if(relays.none()) throw runtime_error("no relays; TLE7230Scheduler::pwm()");
+            return __add(start, device, relays.to_ulong(), 0, period, onTime);
+        }
+
+        Id pwm(int device, int relay, Clock::duration period, Clock::duration onTime, Clock::time_point start = Clock::now())
+        {
+            return pwm(device, bitset<8>(__relayBit(relay)), period, onTime, start);
+        }
+
+        // Drops a queued change or stops a PWM pattern (the relays keep their current state)
+        // @return false if id was already carried out (one-shot) or cancelled
+        bool cancel(Id id)
+        {
+            lock_guard<mutex> g(lock);
+            for(const Entry& e : heap) if(e.id == id && !cancelled.count(id)) {cancelled.insert(id); return true;}
+            return false;
+        }
+
+        // @return changes queued (a PWM pattern counts once)
+        size_t pending()
+        {
+            lock_guard<mutex> g(lock);
+            return heap.size() - cancelled.size();
+        }
+
+        Timing getTiming()
+        {
+            lock_guard<mutex> g(lock);
+            Timing t = timing;
+            if(t.changes) t.meanError = errorSum / t.changes;
+            return t;
+        }
+
+        void resetTiming()
+        {
+            lock_guard<mutex> g(lock);
+            timing = Timing();
+            errorSum = chrono::nanoseconds(0);
+        }
+
+        // @return true if the thread got the SCHED_FIFO priority it asked for
+        bool isRealtime() {return realtime;}
+
+        Clock::duration getTick() const {return tick;}
+};
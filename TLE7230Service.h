@@ -0,0 +1,536 @@
+/*****TLE7230Service: one process owns the TLE7230, any number of local processes use it ******************************
+TLE7230Server runs next to the driver (see TLE7230Daemon.cpp) and takes batches of relay/register commands from local
+clients over a Unix domain socket. It also publishes the live diagnosis and relay outputs in a POSIX shared-memory
+segment, which clients read with plain loads: no system calls, no round trip to the server.
+
+    //in the process that owns the bus
+    TLE7230 relays(...);
+    relays.startDiagPoller(chrono::milliseconds(10));           //keeps the published diagnosis fresh
+    TLE7230Server server(relays, "/run/tle7230.sock", "/tle7230");
+
+    //in any other process (link with -lrt on older glibc)
+    TLE7230Client client("/run/tle7230.sock", "/tle7230");
+    client.turnRelayOn(1, 3);
+    TLE7230::Batch batch;                                       //several commands, one round trip, one execute()
+    batch.turnRelaysOn(1, 0b00110000); batch.readRegister(2, TLE7230::OVL);
+    vector<TLE7230::BatchResult> results = client.execute(batch);
+    bitset<16> diag = client.getDiagStatus(2);                  //from shared memory
+
+Protocol: SOCK_SEQPACKET, one message per request and one per reply. Request: WireHeader + count 4-byte WireOps
+(TLE7230::Batch::Op), run as one TLE7230::Batch, so the Batch ordering rules apply. Reply: WireHeader (tag echoed,
+error set if the batch was refused) + count 8-byte WireResults. Integers are in host byte order: local use only.
+Shared memory: SharedState, a seqlock like TLE7230::getDiagSnapshot(); heartbeat lets clients spot a dead server.
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+namespace TLE7230Wire
+{
+    static constexpr int MAX_OPS = 1024;     //operations per request
+    static constexpr int MAX_DEVICES = 64;   //devices published in shared memory
+
+    enum Error : uint16_t {OK, MALFORMED, TOO_MANY_OPS, REJECTED};
+
+    struct WireHeader
+    {
+        uint32_t tag;      //request: anything, reply: the request's
+        uint16_t count;    //operations that follow
+        uint16_t error;    //reply only, Error
+    };
+
+    struct WireOp
+    {
+        uint8_t kind;      //TLE7230::Batch::Kind
+        uint8_t device;
+        uint8_t addr;
+        uint8_t data;
+    };
+
+    struct WireResult
+    {
+        int32_t status;
+        uint16_t diag;
+        uint8_t value;
+        uint8_t reserved;
+    };
+
+    // The shared-memory segment: written by the server only
+    struct SharedState
+    {
+        char magic[8];                          //"TLE7230S"
+        uint32_t version;
+        uint32_t devices;
+        atomic<uint64_t> sequence;              //seqlock: odd while the server writes, +2 per publish
+        atomic<int64_t> time;                   //system_clock ns when the newest diagnosis in it arrived
+        atomic<uint64_t> diagSequence;          //TLE7230::DiagSnapshot::sequence it was taken from
+        atomic<int64_t> heartbeat;              //steady_clock ns of the server's last pass, outside the seqlock
+        atomic<uint16_t> diag[MAX_DEVICES];     //diag[device-1]
+        atomic<uint8_t> outputs[MAX_DEVICES];   //CTL of device, bit relay-1 on
+    };
+
+    static constexpr uint32_t VERSION = 1;
+}
+
+class TLE7230Server
+{
+    public:
+        // @param driver not owned; used from the server's thread, so every other user must go through its bus lock as usual
+        // @param socketPath Unix socket to listen on, replaced if a stale one is left over
+        // @param shmName shm_open() name, e.g. "/tle7230"
+        // @param interval how often diagnosis/outputs are published when no request comes in
+        // @throws runtime_error if the socket or shared memory can't be set up, or a server already listens on socketPath
+        TLE7230Server(TLE7230& driver, string socketPath, string shmName, chrono::milliseconds interval = chrono::milliseconds(10))
+        : driver(driver), socketPath(move(socketPath)), shmName(move(shmName)), interval(interval)
+        {
+            if(driver.getDeviceCount() > TLE7230Wire::MAX_DEVICES) throw runtime_error("too many devices; TLE7230Server()");
+            try
+            {
+                __listen(); //first: a live server's segment must not be touched
+                __openSharedState();
+                stopEvent = eventfd(0, EFD_CLOEXEC);
+                if(stopEvent < 0) throw runtime_error("eventfd failed; TLE7230Server()");
+            }
+            catch(...)
+            {
+                __close();
+                throw;
+            }
+            __publish(true);
+            worker = thread(&TLE7230Server::__loop, this);
+        }
+
+        // Stops serving: clients see their socket closed and the heartbeat stop. The socket and segment are removed
+        ~TLE7230Server()
+        {
+            uint64_t one = 1;
+            if(write(stopEvent, &one, sizeof one) < 0) perror("TLE7230Server");
+            worker.join();
+            __close();
+        }
+
+        struct Stats
+        {
+            unsigned long long requests = 0;   //batches received
+            unsigned long long operations = 0; //operations run
+            unsigned long long refused = 0;    //requests answered with an error
+            unsigned long long publishes = 0;  //shared-memory updates
+            int clients = 0;                   //connected now
+        };
+
+        Stats getStats()
+        {
+            lock_guard<mutex> g(statsLock);
+            return stats;
+        }
+
+    private:
+        TLE7230& driver;
+        string socketPath, shmName;
+        chrono::milliseconds interval;
+        int listener = -1;
+        int stopEvent = -1;
+        TLE7230Wire::SharedState* shared = nullptr;
+        vector<int> clients;
+        thread worker;
+        mutex statsLock;
+        Stats stats;
+        TLE7230::DiagSnapshot snapshot;
+        TLE7230::RelayState outputs;
+
+        void __openSharedState()
+        {
+            int fd = shm_open(shmName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if(fd < 0) throw runtime_error("shm_open failed: " + string(strerror(errno)) + "; TLE7230Server()");
+            int result = ftruncate(fd, sizeof(TLE7230Wire::SharedState));
+            void* map = result < 0 ? MAP_FAILED : mmap(nullptr, sizeof(TLE7230Wire::SharedState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(map == MAP_FAILED) throw runtime_error("could not map shared memory; TLE7230Server()");
+            shared = new(map) TLE7230Wire::SharedState();
+            shared->version = TLE7230Wire::VERSION;
+            shared->devices = driver.getDeviceCount();
+            for(auto& d : shared->diag) d.store(0xFFFF, memory_order_relaxed);
+            memcpy(shared->magic, "TLE7230S", 8); //last: clients check it
+        }
+
+        void __listen()
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if(socketPath.size() >= sizeof addr.sun_path) throw runtime_error("socket path too long; TLE7230Server()");
+            strcpy(addr.sun_path, socketPath.c_str());
+            //a server still answering keeps its socket, a stale file from a crash is removed
+            int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            bool live = probe >= 0 && connect(probe, (sockaddr*)&addr, sizeof addr) == 0;
+            if(probe >= 0) close(probe);
+            if(live) throw runtime_error("a server already listens on " + socketPath + "; TLE7230Server()");
+            unlink(socketPath.c_str());
+
+            listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+            if(listener < 0 || bind(listener, (sockaddr*)&addr, sizeof addr) < 0 || ::listen(listener, 16) < 0)
+                throw runtime_error("could not listen on " + socketPath + ": " + strerror(errno) + "; TLE7230Server()");
+        }
+
+        void __close()
+        {
+            for(int c : clients) close(c);
+            clients.clear();
+            if(listener >= 0)
+            {
+                close(listener);
+                unlink(socketPath.c_str());
+            }
+            if(stopEvent >= 0) close(stopEvent);
+            if(shared)
+            {
+                shared->heartbeat.store(0, memory_order_release);
+                munmap(shared, sizeof(TLE7230Wire::SharedState));
+                shm_unlink(shmName.c_str());
+            }
+            listener = stopEvent = -1;
+            shared = nullptr;
+        }
+
+        //copies the driver's latest diagnosis and relay outputs into shared memory when either changed
+        void __publish(bool force)
+        {
+            auto now = chrono::steady_clock::now();
+            shared->heartbeat.store(now.time_since_epoch().count(), memory_order_release);
+            uint64_t before = snapshot.sequence;
+            TLE7230::RelayState previous = outputs;
+            driver.getDiagSnapshot(snapshot);
+            try {outputs = driver.getRelayState();}
+            catch(const exception&) {} //keeps the last known outputs
+            if(!force && snapshot.sequence == before && outputs == previous) return;
+
+            //steady -> wall clock, like the diagnosis history
+            int64_t wall = snapshot.time == chrono::steady_clock::time_point() ? 0 :
+                chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch() - now.time_since_epoch() +
+                                                    snapshot.time.time_since_epoch()).count();
+            uint64_t seq = shared->sequence.load(memory_order_relaxed);
+            shared->sequence.store(seq + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            for(int d = 0; d < driver.getDeviceCount(); ++d)
+            {
+                shared->diag[d].store(snapshot.diag[d].to_ulong(), memory_order_relaxed);
+                if(d < (int)outputs.size()) shared->outputs[d].store(outputs[d].to_ulong(), memory_order_relaxed);
+            }
+            shared->time.store(wall, memory_order_relaxed);
+            shared->diagSequence.store(snapshot.sequence, memory_order_relaxed);
+            shared->sequence.store(seq + 2, memory_order_release);
+            lock_guard<mutex> g(statsLock);
+            ++stats.publishes;
+        }
+
+        //one request from client fd; false if the client is gone
+        bool __serve(int fd, vector<char>& message)
+        {
+            using namespace TLE7230Wire;
+            ssize_t length = recv(fd, message.data(), message.size(), MSG_DONTWAIT);
+            if(length < 0) return errno == EAGAIN || errno == EINTR;
+            if(length == 0) return false;
+
+            WireHeader request{};
+            WireHeader reply{};
+            vector<TLE7230::BatchResult> results;
+            if(size_t(length) < sizeof request) reply.error = MALFORMED;
+            else
+            {
+                memcpy(&request, message.data(), sizeof request);
+                reply.tag = request.tag;
+                if(request.count > MAX_OPS) reply.error = TOO_MANY_OPS;
+                else if(size_t(length) != sizeof request + request.count*sizeof(WireOp)) reply.error = MALFORMED;
+            }
+            if(reply.error == OK)
+            {
+                TLE7230::Batch batch;
+                try
+                {
+                    for(int i = 0; i < request.count; ++i)
+                    {
+                        WireOp op;
+                        memcpy(&op, message.data() + sizeof request + i*sizeof op, sizeof op);
+                        __add(batch, op);
+                    }
+                    results = driver.execute(batch);
+                }
+                catch(const exception&) {reply.error = REJECTED;} //invalid kind/device/address/relay
+            }
+            reply.count = results.size();
+
+            vector<char> out(sizeof reply + results.size()*sizeof(WireResult));
+            memcpy(out.data(), &reply, sizeof reply);
+            for(size_t i = 0; i < results.size(); ++i)
+            {
+                WireResult r{results[i].status, uint16_t(results[i].diag.to_ulong()), results[i].value, 0};
+                memcpy(out.data() + sizeof reply + i*sizeof r, &r, sizeof r);
+            }
+            //a client that doesn't read its replies is dropped rather than stalling everyone
+            bool sent = send(fd, out.data(), out.size(), MSG_DONTWAIT | MSG_NOSIGNAL) == ssize_t(out.size());
+            lock_guard<mutex> g(statsLock);
+            ++stats.requests;
+            stats.operations += results.size();
+            if(reply.error != OK) ++stats.refused;
+            return sent;
+        }
+
+        //kind is range-checked before it becomes a Batch::Kind; the rest is Batch::add()'s to check
+        static void __add(TLE7230::Batch& batch, const TLE7230Wire::WireOp& op)
+        {
+            if(op.kind > TLE7230::Batch::DIAGNOSIS) throw runtime_error("invalid operation; TLE7230Server");
+            batch.add(TLE7230::Batch::Op{TLE7230::Batch::Kind(op.kind), op.device, char(op.addr), char(op.data)});
+        }
+
+        void __loop()
+        {
+            vector<pollfd> fds;
+            vector<char> message(sizeof(TLE7230Wire::WireHeader) + TLE7230Wire::MAX_OPS*sizeof(TLE7230Wire::WireOp) + 1);
+            auto next = chrono::steady_clock::now() + interval;
+            while(true)
+            {
+                fds.assign({{stopEvent, POLLIN, 0}, {listener, POLLIN, 0}});
+                for(int c : clients) fds.push_back({c, POLLIN, 0});
+                auto wait = chrono::duration_cast<chrono::milliseconds>(next - chrono::steady_clock::now()).count();
+                int ready = poll(fds.data(), fds.size(), max<long long>(0, wait));
+                if(ready < 0 && errno != EINTR) break;
+                if(fds[0].revents) break;
+
+                bool served = false;
+                if(fds[1].revents & POLLIN)
+                    for(int c; (c = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) >= 0;) clients.push_back(c);
+                for(size_t i = 2; i < fds.size(); ++i)
+                {
+                    if(!fds[i].revents) continue;
+                    bool alive = !(fds[i].revents & (POLLERR | POLLNVAL)) && (fds[i].revents & POLLIN ? __serve(fds[i].fd, message) : false);
+                    served |= alive;
+                    if(!alive)
+                    {
+                        close(fds[i].fd);
+                        clients.erase(find(clients.begin(), clients.end(), fds[i].fd));
+                    }
+                }
+                {
+                    lock_guard<mutex> g(statsLock);
+                    stats.clients = clients.size();
+                }
+                //replies first, then what the requests changed goes out to shared memory straight away
+                if(served || chrono::steady_clock::now() >= next)
+                {
+                    __publish(false);
+                    if(chrono::steady_clock::now() >= next) next = chrono::steady_clock::now() + interval;
+                }
+            }
+        }
+};
+
+class TLE7230Client
+{
+    public:
+        // Everything in shared memory at one instant
+        struct State
+        {
+            uint64_t sequence = 0;                       //changes with every publish
+            chrono::system_clock::time_point time;       //when the newest diagnosis in it arrived (epoch = never)
+            vector<bitset<16>> diag;                     //diag[device-1], as TLE7230::getDiagStatus()
+            TLE7230::RelayState outputs;                 //outputs[device-1], as TLE7230::getRelayState()
+        };
+
+        // @param socketPath/shmName as given to the TLE7230Server @throws runtime_error if the server can't be reached
+        TLE7230Client(const string& socketPath, const string& shmName)
+        {
+            try
+            {
+                __mapSharedState(shmName);
+                __connect(socketPath);
+            }
+            catch(...)
+            {
+                __close();
+                throw;
+            }
+        }
+
+        ~TLE7230Client() {__close();}
+
+        TLE7230Client(const TLE7230Client&) = delete;
+        TLE7230Client& operator=(const TLE7230Client&) = delete;
+
+        int getDeviceCount() {return shared->devices;}
+
+        // Runs a batch on the server's driver: one round trip, one TLE7230::execute() there. Safe from several threads
+        // @return one BatchResult per operation, as TLE7230::execute()
+        // @throws runtime_error if the server refused the batch (invalid device/address/relay, too many operations)
+        //         or the connection is lost
+        vector<TLE7230::BatchResult> execute(const TLE7230::Batch& batch)
+        {
+            using namespace TLE7230Wire;
+            const vector<TLE7230::Batch::Op>& ops = batch.operations();
+            if(ops.size() > MAX_OPS) throw runtime_error("too many operations; TLE7230Client::execute()");
+            vector<char> message(sizeof(WireHeader) + ops.size()*sizeof(WireOp));
+            vector<char> reply(sizeof(WireHeader) + ops.size()*sizeof(WireResult));
+            vector<TLE7230::BatchResult> results(ops.size());
+
+            lock_guard<mutex> g(lock);
+            WireHeader header{++tag, uint16_t(ops.size()), OK};
+            memcpy(message.data(), &header, sizeof header);
+            for(size_t i = 0; i < ops.size(); ++i)
+            {
+                WireOp op{uint8_t(ops[i].kind), uint8_t(ops[i].device), uint8_t(ops[i].addr), uint8_t(ops[i].data)};
+                memcpy(message.data() + sizeof header + i*sizeof op, &op, sizeof op);
+            }
+            if(send(fd, message.data(), message.size(), MSG_NOSIGNAL) != ssize_t(message.size()))
+                throw runtime_error("lost connection to the server; TLE7230Client::execute()");
+            ssize_t length;
+            do length = recv(fd, reply.data(), reply.size(), 0); while(length < 0 && errno == EINTR);
+            if(length < ssize_t(sizeof header)) throw runtime_error("lost connection to the server; TLE7230Client::execute()");
+            memcpy(&header, reply.data(), sizeof header);
+            if(header.error != OK) throw runtime_error("batch refused by the server; TLE7230Client::execute()");
+            if(header.tag != tag || header.count != ops.size() || size_t(length) != reply.size())
+                throw runtime_error("malformed reply; TLE7230Client::execute()");
+            for(size_t i = 0; i < ops.size(); ++i)
+            {
+                WireResult r;
+                memcpy(&r, reply.data() + sizeof header + i*sizeof r, sizeof r);
+                results[i].status = r.status;
+                results[i].value = r.value;
+                results[i].diag = bitset<16>(r.diag);
+            }
+            return results;
+        }
+
+        // Single commands, one round trip each; same return values as TLE7230's
+        int writeRegister(int device, char addr, char data) {return __one([&](TLE7230::Batch& b){b.writeRegister(device, addr, data);}).status;}
+        int turnRelayOn(int device, int relay)  {return __one([&](TLE7230::Batch& b){b.turnRelayOn(device, relay);}).status;}
+        int turnRelayOff(int device, int relay) {return __one([&](TLE7230::Batch& b){b.turnRelayOff(device, relay);}).status;}
+        int turnRelaysOn(int device, bitset<8> relays)  {return __one([&](TLE7230::Batch& b){b.turnRelaysOn(device, relays);}).status;}
+        int turnRelaysOff(int device, bitset<8> relays) {return __one([&](TLE7230::Batch& b){b.turnRelaysOff(device, relays);}).status;}
+        int resetRegisters(int device) {return __one([&](TLE7230::Batch& b){b.resetRegisters(device);}).status;}
+        int updateDiagStatus(int device) {return __one([&](TLE7230::Batch& b){b.updateDiagStatus(device);}).status;}
+        // @throws runtime_error if SPI failed on the server
+        char readRegister(int device, char addr)
+        {
+            TLE7230::BatchResult r = __one([&](TLE7230::Batch& b){b.readRegister(device, addr);});
+            if(r.status < 0) throw runtime_error("spi communication failed; TLE7230Client::readRegister()");
+            return r.value;
+        }
+
+        // Shared-memory reads: plain loads, no system calls, safe from any number of threads
+        // @param out filled in; its vectors are reused so repeated calls don't allocate
+        void getState(State& out)
+        {
+            int devices = shared->devices;
+            out.diag.resize(devices);
+            out.outputs.resize(devices);
+            uint64_t before, after;
+            do
+            {
+                before = shared->sequence.load(memory_order_acquire);
+                for(int d = 0; d < devices; ++d)
+                {
+                    out.diag[d] = bitset<16>(shared->diag[d].load(memory_order_relaxed));
+                    out.outputs[d] = bitset<8>(shared->outputs[d].load(memory_order_relaxed));
+                }
+                out.time = chrono::system_clock::time_point(chrono::duration_cast<chrono::system_clock::duration>(
+                    chrono::nanoseconds(shared->time.load(memory_order_relaxed))));
+                atomic_thread_fence(memory_order_acquire);
+                after = shared->sequence.load(memory_order_relaxed);
+            } while(before != after || (before & 1));
+            out.sequence = before / 2;
+        }
+
+        State getState()
+        {
+            State out;
+            getState(out);
+            return out;
+        }
+
+        // One word needs no seqlock: it is written with a single store
+        // @param device 1 to getDeviceCount() @throws runtime_error
+        bitset<16> getDiagStatus(int device) {return bitset<16>(shared->diag[__check(device)].load(memory_order_acquire));}
+        bitset<8> getOutputs(int device) {return bitset<8>(shared->outputs[__check(device)].load(memory_order_acquire));}
+        int relayStatus(int device, int relay)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Client");
+            return getDiagStatus(device).to_ulong() >> (relay*2-2) & 0b11;
+        }
+
+        // Every device's diagnosis decoded, see TLE7230::decodeDiag() @param out out[device-1]
+        void getFaultMasks(vector<TLE7230::FaultMasks>& out)
+        {
+            int devices = shared->devices;
+            uint16_t words[TLE7230Wire::MAX_DEVICES];
+            uint64_t before, after;
+            do
+            {
+                before = shared->sequence.load(memory_order_acquire);
+                for(int d = 0; d < devices; ++d) words[d] = shared->diag[d].load(memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                after = shared->sequence.load(memory_order_relaxed);
+            } while(before != after || (before & 1));
+            out.resize(devices);
+            TLE7230::decodeDiag(words, nullptr, devices, out.data());
+        }
+
+        // @return true if the server's loop ran within maxSilence (it passes at least every publish interval)
+        bool isServerAlive(chrono::steady_clock::duration maxSilence = chrono::milliseconds(500))
+        {
+            int64_t beat = shared->heartbeat.load(memory_order_acquire);
+            return beat && chrono::steady_clock::now().time_since_epoch() - chrono::steady_clock::duration(beat) <= maxSilence;
+        }
+
+    private:
+        int fd = -1;
+        const TLE7230Wire::SharedState* shared = nullptr;
+        mutex lock;
+        uint32_t tag = 0;
+
+        void __close()
+        {
+            if(fd >= 0) close(fd);
+            if(shared) munmap((void*)shared, sizeof(TLE7230Wire::SharedState));
+            fd = -1;
+            shared = nullptr;
+        }
+
+        void __mapSharedState(const string& shmName)
+        {
+            int shm = shm_open(shmName.c_str(), O_RDONLY, 0);
+            if(shm < 0) throw runtime_error("shm_open " + shmName + " failed: " + strerror(errno) + "; TLE7230Client()");
+            void* map = mmap(nullptr, sizeof(TLE7230Wire::SharedState), PROT_READ, MAP_SHARED, shm, 0);
+            close(shm);
+            if(map == MAP_FAILED) throw runtime_error("could not map shared memory; TLE7230Client()");
+            shared = static_cast<const TLE7230Wire::SharedState*>(map);
+            if(memcmp(shared->magic, "TLE7230S", 8) || shared->version != TLE7230Wire::VERSION || shared->devices > TLE7230Wire::MAX_DEVICES)
+                throw runtime_error("not a TLE7230Server segment: " + shmName + "; TLE7230Client()");
+        }
+
+        void __connect(const string& socketPath)
+        {
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if(socketPath.size() >= sizeof addr.sun_path) throw runtime_error("socket path too long; TLE7230Client()");
+            strcpy(addr.sun_path, socketPath.c_str());
+            fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+            if(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof addr) < 0)
+                throw runtime_error("could not connect to " + socketPath + ": " + strerror(errno) + "; TLE7230Client()");
+        }
+
+        int __check(int device)
+        {
+            if(device < 1 || device > int(shared->devices)) throw runtime_error("invalid device; TLE7230Client");
+            return device - 1;
+        }
+
+        template <typename Add> TLE7230::BatchResult __one(Add add)
+        {
+            TLE7230::Batch batch;
+            add(batch);
+            return execute(batch)[0];
+        }
+};
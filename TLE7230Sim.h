@@ -0,0 +1,349 @@
+/*****TLE7230Sim: software model of TLE7230 chips behind a TLE7230::Transport ****************************
+Lets the driver run (and be timed) without a Pi or pigpiod:
+
+    TLE7230Sim sim;                  //two chips on CE0/CE1, or TLE7230Sim sim(true) for a daisy chain on CE0
+    TLE7230 relays(sim);             //TLE7230 relays(sim, true) for the daisy chain
+    relays.turnRelayOn(1, 3);
+    sim.getRegister(1, TLE7230::CTL) //0b00000100
+
+g++ -pthread -DTLE7230_NO_PIGPIO [main.cpp] -o [main] -std=c++20
+
+What is modelled:
+    16-bit frames, MSB first: [15:14] command, [13:8] address, [7:0] data
+    the response to a command is shifted out on the NEXT frame: the register in [7:0] with the read command echoed in
+        [15:8] after a read, otherwise the diagnosis word as it stands when CSn goes low
+    daisy chain: the chips form one long shift register, MOSI -> chip 1 -> chip 2 -> ... -> chip N -> MISO, and every
+        chip latches whatever 16 bits it holds when CSn goes high. Frames that are not 2N bytes long shift the same way
+    RESET_DEVICE and RSTn low put the registers back to their defaults (MAP = 0b00001000, everything else 0)
+    diagnosis: 2 bits per channel, CH8 in [15:14] ... CH1 in [1:0], 0b11 normal. Faults are injected with setFault()
+    latching shutdown: an overload (overtemperature) on a channel that is on latches it off if its OVL (OVT) bit is
+        set. The latch clears when the channel's CTL bit is written to 0
+    FLTn: low while any channel of a chip reports something other than normal. Chip 1 drives FLTN1 (GPIO14), the
+        other chips share FLTN2 (GPIO15) like an open-drain wired-OR. gpioCallback() fires on their edges, on the thread
+        whose call (setFault(), a frame, RSTn) moved the pin
+    a marginal link (off unless setLinkLimit() is called): above a given SCLK, bits flip at random on MOSI and MISO
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <mutex>
+#include <map>
+#include <deque>
+#include <thread>
+#include <random>
+
+class TLE7230Sim : public TLE7230::Transport
+{
+    public:
+        static constexpr int FLTN1 = 14;
+        static constexpr int FLTN2 = 15;
+        static constexpr int RSTN  = 16;
+
+    private:
+        struct Chip
+        {
+            array<unsigned char, 8> reg{};   //reg[addr], addr 1 to 7
+            array<int, 8> fault;             //injected status per channel, RELAY_CH_x
+            array<bool, 8> overtemp{};       //injected overtemperature per channel
+            unsigned char latched = 0;       //channels shut off by a latching overload/overtemperature
+            uint16_t response = 0;           //read result loaded into the shift register at the next CSn falling edge
+            bool diagnosisNext = true;       //otherwise the next frame shifts out the fresh diagnosis word
+        };
+
+        vector<Chip> chips;
+        bool daisyChain;
+        map<int, int> gpioLevel;             //levels written by the driver, plus pulled-up inputs
+        array<bool, 2> channelOpen{};
+        array<int, 2> channelBaud{};
+        int errorBaud = 0;                   //setLinkLimit(): channels opened faster than this get bit errors
+        double bitErrorRate = 0;
+        mt19937 noise;
+        atomic<int64_t> transferDelayNs{0};  //setTransferDelay(), read before the lock is taken
+        unsigned long long transfers = 0;
+        unsigned long long bytes = 0;
+        mutable recursive_mutex lock;
+        map<int, pair<int, pair<int, EdgeCallback>>> callbacks; //id -> (gpio, (edge, fn))
+        int nextCallback = 0;
+        array<int, 2> faultLevel = {1, 1};                     //FLTN1, FLTN2 as last reported to callbacks
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+        static constexpr unsigned char DEFAULTS[8] = {0, 0b00001000, 0, 0, 0, 0, 0, 0};
+
+        static void __reset(Chip& c)
+        {
+            copy(begin(DEFAULTS), end(DEFAULTS), c.reg.begin());
+            c.latched = 0;
+        }
+
+        //latching shutdown, evaluated whenever CTL, OVL/OVT or the injected faults change
+        void __updateLatches(Chip& c)
+        {
+            for(int ch = 0; ch < 8; ++ch)
+            {
+                if(!(c.reg[TLE7230::CTL] >> ch & 1)) continue;
+                bool ovl = c.fault[ch] == TLE7230::RELAY_CH_OVERLOAD && (c.reg[TLE7230::OVL] >> ch & 1);
+                bool ovt = c.overtemp[ch] && (c.reg[TLE7230::OVT] >> ch & 1);
+                if(ovl || ovt) c.latched |= 1 << ch;
+            }
+            c.reg[TLE7230::STA] = c.reg[TLE7230::CTL] & ~c.latched;
+        }
+
+        uint16_t __diagnosis(const Chip& c) const
+        {
+            uint16_t d = 0;
+            for(int ch = 0; ch < 8; ++ch)
+            {
+                int status = c.overtemp[ch] || (c.latched >> ch & 1) ? TLE7230::RELAY_CH_OVERLOAD : c.fault[ch];
+                d |= status << (ch*2);
+            }
+            return d;
+        }
+
+        //what the chip does when CSn goes high holding word
+        void __execute(Chip& c, uint16_t word)
+        {
+            int cmd  = word >> 14;
+            int addr = word >> 8 & 0x3F;
+            unsigned char data = word & 0xFF;
+            c.diagnosisNext = true;
+            if(!rstnHigh()) return; //held in reset, nothing is latched
+            switch(cmd)
+            {
+                case 0b01: //READ_REGISTER
+                    c.response = (word & 0xFF00) | (addr < 8 ? c.reg[addr] : 0);
+                    c.diagnosisNext = false;
+                    return;
+                case 0b10: //RESET_DEVICE
+                    __reset(c);
+                    break;
+                case 0b11: //WRITE_REGISTER
+                    if(addr >= TLE7230::MAP && addr <= TLE7230::CTL && addr != TLE7230::STA)
+                    {
+                        if(addr == TLE7230::CTL) c.latched &= data; //turning a channel off clears its latch
+                        c.reg[addr] = data;
+                    }
+                    break;
+                default: //DIAGNOSIS_ONLY
+                    break;
+            }
+            __updateLatches(c);
+        }
+
+        int __faultPin(int device) const {return device == 1 ? FLTN1 : FLTN2;}
+
+        int __faultPinLevel(int gpio) const
+        {
+            for(size_t d = 1; d <= chips.size(); ++d)
+                if(__faultPin(d) == gpio && __diagnosis(chips[d-1]) != 0xFFFF) return 0;
+            return 1;
+        }
+
+        //fires edge callbacks for FLTn pins that moved since the last check
+        void __checkFaultPins()
+        {
+            for(int i = 0; i < 2; ++i)
+            {
+                int gpio = i ? FLTN2 : FLTN1, level = __faultPinLevel(gpio);
+                if(level == faultLevel[i]) continue;
+                faultLevel[i] = level;
+                uint32_t tick = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+                for(auto& c : callbacks)
+                {
+                    int edge = c.second.second.first;
+                    if(c.second.first == gpio && (edge == EDGE_EITHER || (edge == EDGE_RISING) == (level == 1)))
+                        c.second.second.second(gpio, level, tick);
+                }
+            }
+        }
+
+        void __flipBits(char* bytes, int length)
+        {
+            bernoulli_distribution flip(bitErrorRate);
+            for(int i = 0; i < length; ++i)
+                for(int b = 0; b < 8; ++b) if(flip(noise)) bytes[i] ^= 1 << b;
+        }
+
+        bool rstnHigh() const
+        {
+            auto it = gpioLevel.find(RSTN);
+            return it == gpioLevel.end() || it->second;
+        }
+
+    public:
+        // @param daisyChain false: device 1 on CE0, device 2 on CE1.  true: devices 1..N chained on CE0
+        // @param devices number of chips (2 unless daisy-chained)
+        TLE7230Sim(bool daisyChain = false, int devices = 2) : chips(devices), daisyChain(daisyChain)
+        {
+            if(devices < 1 || (!daisyChain && devices != 2)) throw runtime_error("invalid device count; TLE7230Sim()");
+            for(auto& c : chips)
+            {
+                c.fault.fill(TLE7230::RELAY_CH_OK);
+                __reset(c);
+            }
+        }
+
+        int spiOpen(int channel, int baud, int mode) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            if(channel < 0 || channel > 1 || baud <= 0 || mode != 1) return -1;
+            channelOpen[channel] = true;
+            channelBaud[channel] = baud;
+            return channel;
+        }
+
+        int spiClose(int handle) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            if(handle < 0 || handle > 1 || !channelOpen[handle]) return -1;
+            channelOpen[handle] = false;
+            return 0;
+        }
+
+        int spiXfer(int handle, char *Buffer, int Length) override
+        {
+            if(int64_t delay = transferDelayNs.load(memory_order_relaxed); delay > 0) this_thread::sleep_for(chrono::nanoseconds(delay));
+            lock_guard<recursive_mutex> g(lock);
+            if(handle < 0 || handle > 1 || !channelOpen[handle] || Length < 0) return -1;
+            ++transfers;
+            bytes += Length;
+            //chips on this chip-select, listed from the MISO end: chip N first
+            vector<Chip*> chain;
+            if(daisyChain) {if(handle == 0) for(auto it = chips.rbegin(); it != chips.rend(); ++it) chain.push_back(&*it);}
+            else chain.push_back(&chips[handle]);
+            bool noisy = errorBaud > 0 && channelBaud[handle] > errorBaud;
+            if(noisy) __flipBits(Buffer, Length); //MOSI
+            deque<unsigned char> shift;
+            for(Chip* c : chain)
+            {
+                uint16_t out = !rstnHigh() ? 0 : c->diagnosisNext ? __diagnosis(*c) : c->response;
+                shift.push_back(out >> 8);
+                shift.push_back(out & 0xFF);
+            }
+            for(int i = 0; i < Length; ++i)
+            {
+                unsigned char in = Buffer[i];
+                Buffer[i] = shift.empty() ? 0 : shift.front();
+                if(!shift.empty()) shift.pop_front();
+                if(!chain.empty()) shift.push_back(in);
+            }
+            for(size_t i = 0; i < chain.size(); ++i) __execute(*chain[i], shift[i*2] << 8 | shift[i*2+1]);
+            if(noisy) __flipBits(Buffer, Length); //MISO
+            __checkFaultPins();
+            return Length;
+        }
+
+        int gpioSetMode(int gpio, int mode) override
+        {
+            return gpio < 0 || gpio > 53 || mode < 0 ? -1 : 0;
+        }
+
+        int gpioSetPullUpDown(int gpio, int pud) override
+        {
+            return gpio < 0 || gpio > 53 || pud < PUD_OFF || pud > PUD_UP ? -1 : 0;
+        }
+
+        int gpioRead(int gpio) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            if(gpio == FLTN1 || gpio == FLTN2) return __faultPinLevel(gpio);
+            auto it = gpioLevel.find(gpio);
+            return it == gpioLevel.end() ? 1 : it->second;
+        }
+
+        int gpioWrite(int gpio, int level) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            if(gpio < 0 || gpio > 53) return -1;
+            gpioLevel[gpio] = level != 0;
+            if(gpio == RSTN && !level) for(auto& c : chips) {__reset(c); c.diagnosisNext = true;}
+            __checkFaultPins();
+            return 0;
+        }
+
+        int gpioCallback(int gpio, int edge, EdgeCallback fn) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            if(gpio < 0 || gpio > 53 || edge < EDGE_RISING || edge > EDGE_EITHER) return -1;
+            callbacks[nextCallback] = make_pair(gpio, make_pair(edge, move(fn)));
+            return nextCallback++;
+        }
+
+        int gpioCallbackCancel(int id) override
+        {
+            lock_guard<recursive_mutex> g(lock);
+            return callbacks.erase(id) ? 0 : -1;
+        }
+
+//****************test/benchmark side****************************************************************************
+
+        int devices() const {return chips.size();}
+
+        // @return register contents of one chip, as the hardware has it right now
+        unsigned char getRegister(int device, char addr) const
+        {
+            lock_guard<recursive_mutex> g(lock);
+            return chips.at(device-1).reg.at(addr);
+        }
+
+        // Sets a register behind the driver's back, e.g. to check cache re-sync
+        void setRegister(int device, char addr, unsigned char data)
+        {
+            lock_guard<recursive_mutex> g(lock);
+            chips.at(device-1).reg.at(addr) = data;
+            __updateLatches(chips.at(device-1));
+            __checkFaultPins();
+        }
+
+        // Inject a load fault on one channel
+        // @param status TLE7230::RELAY_CH_OK/OVERLOAD/OPEN/SHORT2GND
+        void setFault(int device, int relay, int status)
+        {
+            lock_guard<recursive_mutex> g(lock);
+            Chip& c = chips.at(device-1);
+            c.fault.at(relay-1) = status & 0b11;
+            __updateLatches(c);
+            __checkFaultPins();
+        }
+
+        void setOvertemperature(int device, int relay, bool hot)
+        {
+            lock_guard<recursive_mutex> g(lock);
+            Chip& c = chips.at(device-1);
+            c.overtemp.at(relay-1) = hot;
+            __updateLatches(c);
+            __checkFaultPins();
+        }
+
+        // @return diagnosis word the chip would report now
+        uint16_t getDiagnosis(int device) const
+        {
+            lock_guard<recursive_mutex> g(lock);
+            return __diagnosis(chips.at(device-1));
+        }
+
+        // @return channels actually driving their load (CTL minus latched-off channels)
+        unsigned char getOutputs(int device) const
+        {
+            lock_guard<recursive_mutex> g(lock);
+            const Chip& c = chips.at(device-1);
+            return c.reg[TLE7230::CTL] & ~c.latched;
+        }
+
+        // Models a link that is only good up to a clock rate, e.g. to try out TLE7230Link's calibration: channels opened
+        // above baud flip each bit on the wire with probability bitErrorRate, in both directions
+        // @param baud fastest clean SCLK, 0 for a perfect link (the default)
+        void setLinkLimit(int baud, double bitErrorRate = 1e-3)
+        {
+            lock_guard<recursive_mutex> g(lock);
+            errorBaud = baud;
+            this->bitErrorRate = bitErrorRate;
+        }
+
+        // Adds a fixed wait to every spiXfer, e.g. to stand in for the pigpiod round-trip
+        void setTransferDelay(chrono::nanoseconds delay) {transferDelayNs.store(delay.count(), memory_order_relaxed);}
+
+        unsigned long long getTransferCount() const {lock_guard<recursive_mutex> g(lock); return transfers;}
+        unsigned long long getByteCount() const {lock_guard<recursive_mutex> g(lock); return bytes;}
+        void clearCounters() {lock_guard<recursive_mutex> g(lock); transfers = bytes = 0;}
+};
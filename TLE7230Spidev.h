@@ -0,0 +1,203 @@
+/*****SpidevTransport: TLE7230 SPI straight through the Linux spidev driver ***************************************
+Every pigpio spi_xfer is a socket round-trip to pigpiod, which for a 2 to 4 byte frame costs far more than the frame.
+This transport does the SPI with SPI_IOC_MESSAGE ioctls on /dev/spidevB.C instead, and a run of frames
+(Transport::spiXferFrames, used by TLE7230::execute) is one ioctl with a chip-select edge between frames.
+spidev has no GPIO, so RSTn/FLTn go through another transport (e.g. PigpioTransport), or are unavailable.
+
+    TLE7230::PigpioTransport gpio;
+    SpidevTransport spi(0, &gpio);          //SPI0: /dev/spidev0.0 and /dev/spidev0.1
+    TLE7230 relays(spi);
+
+Needs the spidev overlay (dtparam=spi=on) and read/write access to /dev/spidev*. SPI mode 1 and the baud passed to the
+TLE7230 constructor are set on the fd exactly like spi_open does.
+
+Without hardware, FakeSpidev stands in for the kernel: it takes the open/ioctl calls and clocks the transfers into any
+other TLE7230::Transport, e.g. a TLE7230Sim:
+
+    TLE7230Sim sim;
+    FakeSpidev kernel(sim);
+    SpidevTransport spi(0, &sim, &kernel);
+    TLE7230 relays(spi);
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+class SpidevTransport : public TLE7230::Transport
+{
+    public:
+        // The system calls the transport makes, so a test can stand in for the kernel (see FakeSpidev)
+        class Syscalls
+        {
+            public:
+                virtual ~Syscalls() = default;
+                virtual int open(const char* path, int flags) {return ::open(path, flags);}
+                virtual int close(int fd) {return ::close(fd);}
+                virtual int ioctl(int fd, unsigned long request, void* arg) {return ::ioctl(fd, request, arg);}
+        };
+
+        // request code of an SPI_IOC_MESSAGE with n transfers; the kernel macro only takes a compile-time n
+        static unsigned long messageRequest(int n) {return _IOC(_IOC_WRITE, SPI_IOC_MAGIC, 0, SPI_MSGSIZE(n));}
+
+        //spidev's default bufsiz; one message can't move more than this
+        static constexpr int MAX_MESSAGE_BYTES = 4096;
+
+    private:
+        int bus;
+        TLE7230::Transport* gpio;
+        Syscalls defaultSys;
+        Syscalls* sys;
+        array<int, 2> fds = {-1, -1};   //handle = chip-select
+        array<uint32_t, 2> speed = {0, 0};
+        vector<spi_ioc_transfer> transfers; //scratch, one per frame
+
+        bool __valid(int handle) {return handle >= 0 && handle < 2 && fds[handle] >= 0;}
+
+    public:
+        // @param bus spidev bus number: 0 = main SPI, 1 = aux SPI
+        // @param gpio transport for RSTn/FLTn (not owned). nullptr: gpio calls fail, FLTn interrupts unavailable
+        // @param sys system calls to use (not owned), nullptr for the real ones
+        SpidevTransport(int bus = 0, TLE7230::Transport* gpio = nullptr, Syscalls* sys = nullptr)
+        : bus(bus), gpio(gpio), sys(sys ? sys : &defaultSys)
+        {
+        }
+
+        ~SpidevTransport()
+        {
+            for(int h = 0; h < 2; ++h) if(fds[h] >= 0) sys->close(fds[h]);
+        }
+
+        int spiOpen(int channel, int baud, int mode) override
+        {
+            if(channel < 0 || channel > 1 || fds[channel] >= 0) return -1;
+            string path = "/dev/spidev" + to_string(bus) + "." + to_string(channel);
+            int fd = sys->open(path.c_str(), O_RDWR);
+            if(fd < 0) return -1;
+            uint8_t m = mode, bits = 8;
+            uint32_t hz = baud;
+            if(sys->ioctl(fd, SPI_IOC_WR_MODE, &m) < 0 || sys->ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+               || sys->ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0)
+            {
+                sys->close(fd);
+                return -1;
+            }
+            fds[channel] = fd;
+            speed[channel] = hz;
+            return channel;
+        }
+
+        int spiClose(int handle) override
+        {
+            if(!__valid(handle)) return -1;
+            int result = sys->close(fds[handle]);
+            fds[handle] = -1;
+            return result;
+        }
+
+        int spiXfer(int handle, char *Buffer, int Length) override
+        {
+            return spiXferFrames(handle, Buffer, Length, 1);
+        }
+
+        // All frames in as few SPI_IOC_MESSAGE ioctls as spidev's buffer allows, cs_change between frames
+        int spiXferFrames(int handle, char *Buffer, int frameLength, int frames) override
+        {
+            if(!__valid(handle) || frameLength <= 0 || frameLength > MAX_MESSAGE_BYTES) return -1;
+            int perMessage = MAX_MESSAGE_BYTES / frameLength;
+            for(int first = 0; first < frames; first += perMessage)
+            {
+                int n = min(perMessage, frames - first);
+                transfers.assign(n, spi_ioc_transfer{});
+                for(int f = 0; f < n; ++f)
+                {
+                    char* frame = Buffer + (first + f)*frameLength;
+                    transfers[f].tx_buf = (unsigned long)frame;
+                    transfers[f].rx_buf = (unsigned long)frame; //spidev copies tx in before it copies rx out
+                    transfers[f].len = frameLength;
+                    transfers[f].speed_hz = speed[handle];
+                    transfers[f].bits_per_word = 8;
+                    transfers[f].cs_change = f < n-1; //release CSn between frames, not after the last one
+                }
+                if(sys->ioctl(fds[handle], messageRequest(n), transfers.data()) < 0) return -1;
+            }
+            return frames*frameLength;
+        }
+
+        int gpioSetMode(int g, int mode) override {return gpio ? gpio->gpioSetMode(g, mode) : -1;}
+        int gpioSetPullUpDown(int g, int pud) override {return gpio ? gpio->gpioSetPullUpDown(g, pud) : -1;}
+        int gpioRead(int g) override {return gpio ? gpio->gpioRead(g) : -1;}
+        int gpioWrite(int g, int level) override {return gpio ? gpio->gpioWrite(g, level) : -1;}
+        int gpioCallback(int g, int edge, EdgeCallback fn) override {return gpio ? gpio->gpioCallback(g, edge, move(fn)) : -1;}
+        int gpioCallbackCancel(int id) override {return gpio ? gpio->gpioCallbackCancel(id) : -1;}
+        int handle() override {return gpio ? gpio->handle() : -1;}
+};
+
+// Pretends to be the spidev driver: open("/dev/spidevB.C") and SPI_IOC_* ioctls on the fds it hands out are
+// carried out against another transport (normally a TLE7230Sim), one spiXfer per chip-select assertion.
+// Also counts the ioctls, so tests can check how many syscalls a workload costs
+class FakeSpidev : public SpidevTransport::Syscalls
+{
+    private:
+        TLE7230::Transport& chips;
+        map<int, int> handles;  //fake fd -> handle on chips
+        int nextFd = 100;
+        vector<char> segment;
+
+    public:
+        unsigned long long messages = 0;  //SPI_IOC_MESSAGE ioctls
+        unsigned long long transfers = 0; //spi_ioc_transfer entries in them
+
+        FakeSpidev(TLE7230::Transport& chips) : chips(chips) {}
+
+        int open(const char* path, int flags) override
+        {
+            int bus, channel;
+            if(sscanf(path, "/dev/spidev%d.%d", &bus, &channel) != 2) return -1;
+            int h = chips.spiOpen(channel, 1, 1); //mode and speed come later by ioctl
+            if(h < 0) return -1;
+            handles[nextFd] = h;
+            return nextFd++;
+        }
+
+        int close(int fd) override
+        {
+            auto it = handles.find(fd);
+            if(it == handles.end()) return -1;
+            chips.spiClose(it->second);
+            handles.erase(it);
+            return 0;
+        }
+
+        int ioctl(int fd, unsigned long request, void* arg) override
+        {
+            auto it = handles.find(fd);
+            if(it == handles.end()) return -1;
+            if(request == SPI_IOC_WR_MODE) return *(uint8_t*)arg == SPI_MODE_1 ? 0 : -1; //the TLE7230 only talks mode 1
+            if(request == SPI_IOC_WR_BITS_PER_WORD) return *(uint8_t*)arg == 8 ? 0 : -1;
+            if(request == SPI_IOC_WR_MAX_SPEED_HZ) return *(uint32_t*)arg ? 0 : -1;
+            if(_IOC_TYPE(request) != SPI_IOC_MAGIC || _IOC_NR(request) != 0 || _IOC_DIR(request) != _IOC_WRITE) return -1;
+            int n = _IOC_SIZE(request) / sizeof(spi_ioc_transfer);
+            spi_ioc_transfer* t = (spi_ioc_transfer*)arg;
+            ++messages;
+            transfers += n;
+            //transfers up to and including one with cs_change (or the last) share one chip-select assertion
+            int total = 0;
+            for(int first = 0; first < n;)
+            {
+                int last = first;
+                while(last < n-1 && !t[last].cs_change) ++last;
+                segment.clear();
+                for(int i = first; i <= last; ++i) segment.insert(segment.end(), (char*)t[i].tx_buf, (char*)t[i].tx_buf + t[i].len);
+                if(chips.spiXfer(it->second, segment.data(), segment.size()) < 0) return -1;
+                size_t off = 0;
+                for(int i = first; i <= last; ++i) {memcpy((char*)t[i].rx_buf, segment.data() + off, t[i].len); off += t[i].len;}
+                total += segment.size();
+                first = last + 1;
+            }
+            return total;
+        }
+};
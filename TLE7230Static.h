@@ -0,0 +1,302 @@
+/*****TLE7230Static: TLE7230 driver with the topology fixed at compile time ****************************************
+The wiring (chip-selects or daisy chain, chain length, pins) is a template parameter, so frame length, byte offsets and
+chip-select choice are constants, and device/register/relay numbers given as template arguments are checked by the
+compiler instead of at run time. What is left on the hot path is filling a fixed-size frame and one spiXfer:
+
+    TLE7230Sim sim(true, 4);                        //or TLE7230::PigpioTransport, SpidevTransport...
+    TLE7230Static<true, 4> relays(sim);             //daisy chain of 4, default pins
+    relays.turnRelayOn<3, 5>();                     //device 3 relay 5, checked when compiling
+    relays.turnRelayOn(device, relay);              //run-time numbers: checked, throws runtime_error like TLE7230
+
+    constexpr TLE7230::Pins board{.fltn1 = 5, .fltn2 = 6, .rstn = 13};
+    TLE7230Static<false, 2, board> other(sim);
+
+This is the lean core only: register/relay access, shadow CTL and diagnosis words. The diagnosis poller, FLTn interrupts,
+register cache policy, Batch and stats are TLE7230's. Not thread-safe; one thread owns it (or put a lock around it).
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+
+template <bool DaisyChain = false, int Devices = 2, TLE7230::Pins P = TLE7230::Pins{}>
+class TLE7230Static
+{
+    static_assert(Devices >= 1, "at least one device");
+    static_assert(DaisyChain || Devices == 2, "2 devices with chip-selects, 1 or more daisy-chained");
+    static_assert(P.csn1 == 8 || P.csn1 == 7, "csn1 must be CE0 (GPIO8) or CE1 (GPIO7) of the main SPI");
+    static_assert(DaisyChain || ((P.csn2 == 8 || P.csn2 == 7) && P.csn2 != P.csn1), "csn2 must be the other CE pin of the main SPI");
+
+    public:
+        static constexpr int FRAME_LENGTH = TLE7230::frameLength(DaisyChain, Devices);
+        static constexpr int CHIP_SELECTS = DaisyChain ? 1 : 2;
+
+    private:
+        using T = TLE7230;
+
+        //OFFSET[device] = byte offset of device in a frame (index 0 unused)
+        static constexpr array<int, Devices+1> OFFSET = []
+        {
+            array<int, Devices+1> o{};
+            for(int d = 1; d <= Devices; ++d) o[d] = T::frameOffset(DaisyChain, Devices, d);
+            return o;
+        }();
+
+        static constexpr int __spiChannel(int csn) {return csn == 8 ? 0 : 1;}
+        static constexpr int __cs(int device) {return DaisyChain ? 0 : device-1;}
+        static constexpr int __first(int device) {return DaisyChain ? 1 : device;}
+        static constexpr int __last(int device) {return DaisyChain ? Devices : device;}
+
+        T::Transport& io;
+        array<int, CHIP_SELECTS> handles;
+        array<char, FRAME_LENGTH> frame;
+        array<char, Devices> lastCmd;       //see TLE7230::lastCmd
+        array<uint16_t, Devices> diag;      //last diagnosis word per device
+        array<unsigned char, Devices> ctl;  //shadow CTL per device, valid when ctlKnown
+        bitset<Devices> ctlKnown;
+
+        // Sends frame on the chip-select of device and files the answers: read results of CTL go to the shadow,
+        // everything else that isn't a read result is a diagnosis word
+        // @return pigpio's SPI R/W return value
+        int __transfer(int device)
+        {
+            array<char, Devices> sent;
+            for(int d = __first(device); d <= __last(device); ++d) sent[d-1] = frame[OFFSET[d]];
+            int result = io.spiXfer(handles[__cs(device)], frame.data(), FRAME_LENGTH);
+            if(result < 0) return result;
+            for(int d = __first(device); d <= __last(device); ++d)
+            {
+                uint16_t word = T::__frameWord(frame.data(), OFFSET[d]);
+                char cmd = lastCmd[d-1];
+                if((char)(cmd & T::COMMAND_MASK) != T::READ_REGISTER) diag[d-1] = word;
+                else if((cmd & T::ADDRESS_MASK) == T::CTL) {ctl[d-1] = word & 0xFF; ctlKnown.set(d-1);}
+                lastCmd[d-1] = sent[d-1];
+            }
+            return result;
+        }
+
+        int __command(int device, char cmd, unsigned char data = 0)
+        {
+            frame.fill(T::DIAGNOSIS_ONLY);
+            frame[OFFSET[device]] = cmd;
+            frame[OFFSET[device]+1] = data;
+            return __transfer(device);
+        }
+
+        int __write(int device, char addr, unsigned char data)
+        {
+            int result = __command(device, T::WRITE_REGISTER | addr, data);
+            if(result >= 0 && addr == T::CTL) {ctl[device-1] = data; ctlKnown.set(device-1);}
+            return result;
+        }
+
+        // @return register contents (0 to 255) or negative pigpio error
+        int __read(int device, char addr)
+        {
+            int result = __command(device, T::READ_REGISTER | addr);
+            if(result < 0) return result;
+            result = __command(device, T::DIAGNOSIS_ONLY); //answer comes back on the next frame
+            if(result < 0) return result;
+            return (unsigned char)frame[OFFSET[device]+1];
+        }
+
+        int __relays(int device, unsigned char on, unsigned char off)
+        {
+            int c = ctlKnown[device-1] ? ctl[device-1] : __read(device, T::CTL);
+            if(c < 0) return c;
+            return __write(device, T::CTL, (c | on) & ~off);
+        }
+
+        int __reset(int device)
+        {
+            int result = __command(device, T::RESET_DEVICE);
+            if(result >= 0) {ctl[device-1] = 0; ctlKnown.set(device-1);} //CTL default
+            return result;
+        }
+
+        static void __checkDevice(int device, const char* method)
+        {
+            if(device < 1 || device > Devices) throw runtime_error(string("invalid device; ") + method);
+        }
+        static void __checkAddress(char addr, const char* method)
+        {
+            if(addr < T::MAP || addr > T::CTL) throw runtime_error(string("invalid address; ") + method);
+        }
+        static unsigned char __relayBit(int relay, const char* method)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error(string("invalid relay; ") + method);
+            return 1 << (relay-1);
+        }
+
+        template <int Device> static constexpr void __assertDevice() {static_assert(Device >= 1 && Device <= Devices, "invalid device");}
+        template <char Addr> static constexpr void __assertAddress() {static_assert(Addr >= T::MAP && Addr <= T::CTL, "invalid address");}
+        template <int Relay> static constexpr void __assertRelay() {static_assert(Relay >= 1 && Relay <= 8, "invalid relay");}
+
+    public:
+        // Opens the SPI channel(s) and sets up RSTn/FLTnX like TLE7230 does. The shadow CTL starts unknown
+        // @param io SPI/GPIO transport (not owned) @param baud SCLK frequency @throws runtime_error if SPI can't be opened
+        TLE7230Static(T::Transport& io, int baud = 4194304) : io(io)
+        {
+            handles.fill(-1);
+            handles[0] = io.spiOpen(__spiChannel(P.csn1), baud, T::SPI_MODE);
+            if(!DaisyChain) handles[CHIP_SELECTS-1] = io.spiOpen(__spiChannel(P.csn2), baud, T::SPI_MODE);
+            for(int h : handles) if(h < 0)
+            {
+                for(int o : handles) if(o >= 0) io.spiClose(o);
+                throw runtime_error("could not open SPI port; TLE7230Static()");
+            }
+            io.gpioSetMode(P.rstn, T::Transport::OUTPUT);
+            io.gpioSetMode(P.fltn1, T::Transport::INPUT);
+            io.gpioSetMode(P.fltn2, T::Transport::INPUT);
+            io.gpioSetPullUpDown(P.fltn1, T::Transport::PUD_UP);
+            io.gpioSetPullUpDown(P.fltn2, T::Transport::PUD_UP);
+            io.gpioSetPullUpDown(P.rstn, T::Transport::PUD_DOWN);
+            lastCmd.fill(T::DIAGNOSIS_ONLY);
+            diag.fill(0xFFFF);
+            ctl.fill(0);
+        }
+
+        ~TLE7230Static()
+        {
+            for(int h : handles) io.spiClose(h);
+        }
+
+        TLE7230Static(const TLE7230Static&) = delete;
+        TLE7230Static& operator=(const TLE7230Static&) = delete;
+
+        // Compile-time device/relay/register numbers. Same meaning and return values as TLE7230's methods of the same name
+
+        template <int Device, int Relay> int turnRelayOn()
+        {
+            __assertDevice<Device>(); __assertRelay<Relay>();
+            return __relays(Device, 1 << (Relay-1), 0);
+        }
+        template <int Device, int Relay> int turnRelayOff()
+        {
+            __assertDevice<Device>(); __assertRelay<Relay>();
+            return __relays(Device, 0, 1 << (Relay-1));
+        }
+        template <int Device> int turnRelaysOn(bitset<8> relays)
+        {
+            __assertDevice<Device>();
+            return __relays(Device, relays.to_ulong(), 0);
+        }
+        template <int Device> int turnRelaysOff(bitset<8> relays)
+        {
+            __assertDevice<Device>();
+            return __relays(Device, 0, relays.to_ulong());
+        }
+        // Writes CTL outright: relays set in on are on, the rest off. No read of the current state needed
+        template <int Device> int setRelays(bitset<8> on)
+        {
+            __assertDevice<Device>();
+            return __write(Device, T::CTL, on.to_ulong());
+        }
+        template <int Device, char Addr> int writeRegister(char data)
+        {
+            __assertDevice<Device>(); __assertAddress<Addr>();
+            return __write(Device, Addr, data);
+        }
+        // @return register contents (0 to 255) or negative pigpio error
+        template <int Device, char Addr> int readRegister()
+        {
+            __assertDevice<Device>(); __assertAddress<Addr>();
+            return __read(Device, Addr);
+        }
+        template <int Device> int resetRegisters()
+        {
+            __assertDevice<Device>();
+            return __reset(Device);
+        }
+        template <int Device> bitset<16> getDiagStatus()
+        {
+            __assertDevice<Device>();
+            return bitset<16>(diag[Device-1]);
+        }
+        // @return RELAY_CH_OK/OVERLOAD/OPEN/SHORT2GND from the last diagnosis word
+        template <int Device, int Relay> int relayStatus()
+        {
+            __assertDevice<Device>(); __assertRelay<Relay>();
+            return diag[Device-1] >> (Relay*2-2) & 0b11;
+        }
+
+        // Run-time device/relay/register numbers, checked. @throws runtime_error on an invalid number
+
+        int turnRelayOn(int device, int relay)
+        {
+            __checkDevice(device, "turnRelayOn()");
+            return __relays(device, __relayBit(relay, "turnRelayOn()"), 0);
+        }
+        int turnRelayOff(int device, int relay)
+        {
+            __checkDevice(device, "turnRelayOff()");
+            return __relays(device, 0, __relayBit(relay, "turnRelayOff()"));
+        }
+        int turnRelaysOn(int device, bitset<8> relays)
+        {
+            __checkDevice(device, "turnRelaysOn()");
+            return __relays(device, relays.to_ulong(), 0);
+        }
+        int turnRelaysOff(int device, bitset<8> relays)
+        {
+            __checkDevice(device, "turnRelaysOff()");
+            return __relays(device, 0, relays.to_ulong());
+        }
+        int setRelays(int device, bitset<8> on)
+        {
+            __checkDevice(device, "setRelays()");
+            return __write(device, T::CTL, on.to_ulong());
+        }
+        int writeRegister(int device, char addr, char data)
+        {
+            __checkDevice(device, "writeRegister()");
+            __checkAddress(addr, "writeRegister()");
+            return __write(device, addr, data);
+        }
+        int readRegister(int device, char addr)
+        {
+            __checkDevice(device, "readRegister()");
+            __checkAddress(addr, "readRegister()");
+            return __read(device, addr);
+        }
+        int resetRegisters(int device)
+        {
+            __checkDevice(device, "resetRegisters()");
+            return __reset(device);
+        }
+        bitset<16> getDiagStatus(int device)
+        {
+            __checkDevice(device, "getDiagStatus()");
+            return bitset<16>(diag[device-1]);
+        }
+        int relayStatus(int device, int relay)
+        {
+            __checkDevice(device, "relayStatus()");
+            __relayBit(relay, "relayStatus()");
+            return diag[device-1] >> (relay*2-2) & 0b11;
+        }
+
+        // DIAGNOSIS_ONLY to every device, one frame per chip-select @return pigpio's SPI R/W return value
+        int updateDiagStatus()
+        {
+            int result = 0;
+            for(int device = 1; device <= Devices && result >= 0; device = __last(device) + 1)
+            {
+                frame.fill(T::DIAGNOSIS_ONLY);
+                result = __transfer(device);
+            }
+            return result;
+        }
+
+        // Drives RSTn; low resets every device, so the shadow CTL is forgotten
+        int writeRSTn(bool level)
+        {
+            if(!level) ctlKnown.reset();
+            return io.gpioWrite(P.rstn, level);
+        }
+
+        int getFLTN1() {return io.gpioRead(P.fltn1);}
+        int getFLTN2() {return io.gpioRead(P.fltn2);}
+        static constexpr int getDeviceCount() {return Devices;}
+        static constexpr bool isDaisyChained() {return DaisyChain;}
+};
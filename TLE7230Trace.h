@@ -0,0 +1,374 @@
+/*****TLE7230Trace: record the SPI/GPIO traffic of a TLE7230, and replay it in place of the hardware *****************
+TLE7230Recorder is a TLE7230::Transport that passes everything on to the real one and appends each frame (chip-select
+channel, tx and rx bytes, time, the driver operation that sent it), GPIO read/write and FLTn edge to a binary trace.
+TLE7230Replay is a Transport that plays a trace back: every frame the driver sends gets the rx bytes recorded for the
+frame at the same position, GPIO reads get the level recorded up to that point, and recorded edges are delivered to
+gpioCallback() subscribers as the replay passes them. A field problem caught on a Pi can then be rerun on any Linux
+machine, as can the driver's CPU cost on that traffic; TLE7230TraceDump.cpp prints and compares traces.
+
+    TLE7230::PigpioTransport pigpio;
+    TLE7230Recorder recorder(pigpio, "field.trace");
+    TLE7230 relays(recorder);
+    recorder.attach(relays);                     //frames are labelled with relays' current operation from now on
+    ...
+
+    TLE7230Replay replay("field.trace");         //elsewhere, same program (same calls, same wiring)
+    TLE7230 relays(replay);
+    replay.attach(relays);                       //frames matched per operation
+    ...
+    TLE7230Replay::Stats s = replay.getStats();  //frames whose tx differed from the trace: where behaviour diverged
+
+Trace: TraceHeader, then records of 16 bytes (TraceRecord), a frame's record followed by its tx then its rx bytes.
+Replay matches frames by position, not content: once the driver sends something else, rx is the hardware's answer to
+what was sent back then, and mismatches counts it. Attached to the driver, the replay keeps one position per driver
+operation, so frames of background threads (fault handler, diagnosis poller) get their own answers even when they
+interleave with the caller's differently than they did while recording; a poller's timing still varies run to run.
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+
+namespace TLE7230Trace
+{
+    static constexpr uint32_t VERSION = 1;
+
+    struct TraceHeader
+    {
+        char magic[8];      //"TLE7230T"
+        uint32_t version;
+        uint32_t recordSize;
+        int64_t start;      //system_clock ns when recording began
+    };
+
+    enum Kind : uint8_t {XFER, GPIO_READ, GPIO_WRITE, EDGE};
+    static constexpr const char* KIND_NAMES[] = {"xfer", "gpioRead", "gpioWrite", "edge"};
+
+    struct TraceRecord
+    {
+        uint64_t time;      //ns since recording began
+        uint8_t kind;       //Kind
+        uint8_t op;         //XFER: TLE7230::Operation that sent it (OP_NONE before attach()), otherwise OP_NONE
+        uint8_t channel;    //XFER: chip-select channel (0 = CE0). GPIO_x/EDGE: gpio
+        uint8_t level;      //GPIO_x/EDGE: level
+        uint16_t length;    //XFER: frame bytes, tx then rx follow the record
+        int16_t result;     //what the transport returned (clamped)
+    };
+
+    struct Entry
+    {
+        TraceRecord record;
+        size_t data;        //offset of tx in Trace::bytes, rx follows
+    };
+
+    struct Trace
+    {
+        TraceHeader header;
+        vector<Entry> entries;
+        vector<char> bytes;
+        const char* tx(const Entry& e) const {return bytes.data() + e.data;}
+        const char* rx(const Entry& e) const {return bytes.data() + e.data + e.record.length;}
+    };
+
+    // Reads a whole trace; a partly written last record (recording process killed) is dropped
+    // @throws runtime_error if path can't be read or isn't a trace
+    static Trace readTrace(const string& path)
+    {
+        Trace t;
+        unique_ptr<FILE, int(*)(FILE*)> f(fopen(path.c_str(), "rb"), fclose);
+        if(!f) throw runtime_error("could not open " + path + "; readTrace()");
+        if(fread(&t.header, sizeof t.header, 1, f.get()) != 1 || memcmp(t.header.magic, "TLE7230T", 8) ||
+           t.header.version != VERSION || t.header.recordSize != sizeof(TraceRecord))
+            throw runtime_error(path + " is not a TLE7230 trace; readTrace()");
+        TraceRecord r;
+        while(fread(&r, sizeof r, 1, f.get()) == 1)
+        {
+            size_t at = t.bytes.size();
+            t.bytes.resize(at + 2*r.length);
+            if(r.length && fread(t.bytes.data() + at, 2*r.length, 1, f.get()) != 1)
+            {
+                t.bytes.resize(at);
+                break;
+            }
+            t.entries.push_back(Entry{r, at});
+        }
+        return t;
+    }
+
+    static int16_t clamp16(int value) {return clamp(value, -32768, 32767);}
+}
+
+class TLE7230Recorder : public TLE7230::Transport
+{
+    public:
+        // @param inner transport doing the real work, not owned @param path trace file, truncated
+        // @throws runtime_error if path can't be written
+        TLE7230Recorder(TLE7230::Transport& inner, const string& path) : inner(inner), file(fopen(path.c_str(), "wb"))
+        {
+            if(!file) throw runtime_error("could not create " + path + "; TLE7230Recorder()");
+            setvbuf(file, nullptr, _IOFBF, 1 << 16);
+            TLE7230Trace::TraceHeader h{};
+            memcpy(h.magic, "TLE7230T", 8);
+            h.version = TLE7230Trace::VERSION;
+            h.recordSize = sizeof(TLE7230Trace::TraceRecord);
+            h.start = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+            fwrite(&h, sizeof h, 1, file);
+        }
+
+        ~TLE7230Recorder() {fclose(file);}
+
+        // Labels frames with driver's current operation. driver must use this transport, and be detached (attach(nullptr))
+        // or outlive the recording
+        void attach(TLE7230* driver) {this->driver = driver;}
+        void attach(TLE7230& driver) {attach(&driver);}
+
+        // Writes out what is buffered, e.g. before copying the file while recording goes on
+        void flush()
+        {
+            lock_guard<mutex> g(lock);
+            fflush(file);
+        }
+
+        // @return frames recorded so far
+        unsigned long long getFrameCount() {return frames;}
+
+        int spiOpen(int channel, int baud, int mode) override
+        {
+            int handle = inner.spiOpen(channel, baud, mode);
+            lock_guard<mutex> g(lock);
+            if(handle >= 0) channels[handle] = channel;
+            return handle;
+        }
+        int spiClose(int handle) override {return inner.spiClose(handle);}
+        int spiXfer(int handle, char *Buffer, int Length) override
+        {
+            vector<char>& tx = __scratch(Length);
+            memcpy(tx.data(), Buffer, Length);
+            int result = inner.spiXfer(handle, Buffer, Length);
+            __frames(handle, tx.data(), Buffer, Length, 1, result);
+            return result;
+        }
+        //keeps the inner transport's batching: the frames go through in one call and are recorded one by one
+        int spiXferFrames(int handle, char *Buffer, int frameLength, int count) override
+        {
+            vector<char>& tx = __scratch(frameLength*count);
+            memcpy(tx.data(), Buffer, frameLength*count);
+            int result = inner.spiXferFrames(handle, Buffer, frameLength, count);
+            __frames(handle, tx.data(), Buffer, frameLength, count, result < 0 ? result : frameLength);
+            return result;
+        }
+        int gpioSetMode(int gpio, int mode) override {return inner.gpioSetMode(gpio, mode);}
+        int gpioSetPullUpDown(int gpio, int pud) override {return inner.gpioSetPullUpDown(gpio, pud);}
+        int gpioRead(int gpio) override
+        {
+            int level = inner.gpioRead(gpio);
+            __gpio(TLE7230Trace::GPIO_READ, gpio, level);
+            return level;
+        }
+        int gpioWrite(int gpio, int level) override
+        {
+            int result = inner.gpioWrite(gpio, level);
+            __gpio(TLE7230Trace::GPIO_WRITE, gpio, level, result);
+            return result;
+        }
+        int gpioCallback(int gpio, int edge, EdgeCallback fn) override
+        {
+            return inner.gpioCallback(gpio, edge, [this, fn = move(fn)](int gpio, int level, uint32_t tick)
+            {
+                __gpio(TLE7230Trace::EDGE, gpio, level);
+                fn(gpio, level, tick);
+            });
+        }
+        int gpioCallbackCancel(int id) override {return inner.gpioCallbackCancel(id);}
+        int handle() override {return inner.handle();}
+
+    private:
+        TLE7230::Transport& inner;
+        FILE* file;
+        TLE7230* driver = nullptr;
+        mutex lock;
+        map<int, int> channels; //spi handle -> channel
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        atomic<unsigned long long> frames{0};
+        //tx copy, per thread: drivers sharing this transport (each with its own bus lock, poller, fault thread) call in
+        //concurrently, and the copy lives across the inner transfer
+        static vector<char>& __scratch(size_t length)
+        {
+            thread_local vector<char> txCopy;
+            if(txCopy.size() < length) txCopy.resize(length);
+            return txCopy;
+        }
+
+        uint64_t __now() {return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();}
+
+        void __frames(int handle, const char* tx, const char* rx, int frameLength, int count, int result)
+        {
+            //the bus lock is held here, so the driver's operation is stable
+            uint8_t op = driver ? driver->getCurrentOperation() : TLE7230::OP_NONE;
+            TLE7230Trace::TraceRecord r{__now(), TLE7230Trace::XFER, op, 0, 0, uint16_t(frameLength), TLE7230Trace::clamp16(result)};
+            lock_guard<mutex> g(lock);
+            auto channel = channels.find(handle);
+            r.channel = channel == channels.end() ? 0xFF : channel->second;
+            for(int f = 0; f < count; ++f)
+            {
+                fwrite(&r, sizeof r, 1, file);
+                fwrite(tx + f*frameLength, frameLength, 1, file);
+                fwrite(rx + f*frameLength, frameLength, 1, file);
+            }
+            frames += count;
+        }
+
+        void __gpio(TLE7230Trace::Kind kind, int gpio, int level, int result = 0)
+        {
+            TLE7230Trace::TraceRecord r{__now(), kind, TLE7230::OP_NONE, uint8_t(gpio), uint8_t(level), 0, TLE7230Trace::clamp16(result)};
+            lock_guard<mutex> g(lock);
+            fwrite(&r, sizeof r, 1, file);
+        }
+};
+
+class TLE7230Replay : public TLE7230::Transport
+{
+    public:
+        struct Stats
+        {
+            unsigned long long frames = 0;       //frames the driver sent
+            unsigned long long mismatches = 0;   //frames whose tx or chip-select channel differed from the trace
+            unsigned long long beyond = 0;       //frames after the trace ran out (answered with all ones)
+            long long firstMismatch = -1;        //frame number of the first mismatch
+            unsigned long long remaining = 0;    //recorded frames not replayed (yet)
+        };
+
+        // @throws runtime_error if path isn't a readable trace
+        TLE7230Replay(const string& path) : trace(TLE7230Trace::readTrace(path))
+        {
+            for(size_t i = 0; i < trace.entries.size(); ++i)
+                if(trace.entries[i].record.kind == TLE7230Trace::XFER)
+                {
+                    frames.push_back(i);
+                    if(trace.entries[i].record.op < TLE7230::OP_COUNT) framesByOp[trace.entries[i].record.op].push_back(i);
+                }
+        }
+
+        // Matches frames per operation of driver (which must use this transport) instead of in plain trace order.
+        // Needs a trace recorded with the recorder attached; nullptr goes back to trace order
+        void attach(TLE7230* driver) {this->driver = driver;}
+        void attach(TLE7230& driver) {attach(&driver);}
+
+        // Back to the start of the trace, stats cleared (e.g. to replay it again in a benchmark loop)
+        void rewind()
+        {
+            lock_guard<mutex> g(lock);
+            cursor = next = 0;
+            nextByOp.fill(0);
+            levels.clear();
+            stats = Stats();
+        }
+
+        Stats getStats()
+        {
+            lock_guard<mutex> g(lock);
+            Stats s = stats;
+            s.remaining = frames.size() - min<unsigned long long>(frames.size(), s.frames - s.beyond);
+            return s;
+        }
+
+        const TLE7230Trace::Trace& getTrace() const {return trace;}
+
+        int spiOpen(int channel, int baud, int mode) override {return channel;}
+        int spiClose(int handle) override {return 0;}
+        int spiXfer(int handle, char *Buffer, int Length) override
+        {
+            vector<pair<EdgeCallback, pair<int, int>>> edges;
+            int result = Length;
+            {
+                lock_guard<mutex> g(lock);
+                long long frame = stats.frames++;
+                //the caller holds the driver's bus lock, so its operation is stable
+                const TLE7230Trace::Entry* e = __next(driver ? driver->getCurrentOperation() : -1, edges);
+                if(!e)
+                {
+                    ++stats.beyond;
+                    memset(Buffer, 0xFF, Length);
+                }
+                else
+                {
+                    const TLE7230Trace::TraceRecord& r = e->record;
+                    bool same = r.channel == handle && r.length == Length && !memcmp(trace.tx(*e), Buffer, Length);
+                    if(!same && !stats.mismatches++) stats.firstMismatch = frame;
+                    memset(Buffer, 0xFF, Length);
+                    memcpy(Buffer, trace.rx(*e), min<int>(Length, r.length));
+                    result = r.result < 0 ? r.result : Length;
+                }
+            }
+            //outside the lock: a subscriber may read GPIOs
+            for(auto& [fn, edge] : edges) fn(edge.first, edge.second, 0);
+            return result;
+        }
+        int gpioSetMode(int gpio, int mode) override {return 0;}
+        int gpioSetPullUpDown(int gpio, int pud) override {return 0;}
+        // @return the level last recorded for gpio up to the frame being replayed (pulled-up FLTn: 1 if never seen)
+        int gpioRead(int gpio) override
+        {
+            lock_guard<mutex> g(lock);
+            auto level = levels.find(gpio);
+            if(level != levels.end()) return level->second;
+            //not seen yet: the first level the trace has for it
+            for(size_t i = cursor; i < trace.entries.size(); ++i)
+            {
+                const TLE7230Trace::TraceRecord& r = trace.entries[i].record;
+                if(r.kind != TLE7230Trace::XFER && r.channel == gpio) return r.level;
+            }
+            return 1;
+        }
+        int gpioWrite(int gpio, int level) override
+        {
+            lock_guard<mutex> g(lock);
+            levels[gpio] = level;
+            return 0;
+        }
+        int gpioCallback(int gpio, int edge, EdgeCallback fn) override
+        {
+            lock_guard<mutex> g(lock);
+            callbacks[nextCallback] = {gpio, move(fn)};
+            return nextCallback++;
+        }
+        int gpioCallbackCancel(int id) override
+        {
+            lock_guard<mutex> g(lock);
+            return callbacks.erase(id) ? 0 : -1;
+        }
+
+    private:
+        TLE7230Trace::Trace trace;
+        TLE7230* driver = nullptr;
+        vector<size_t> frames;                                      //entries that are frames
+        array<vector<size_t>, TLE7230::OP_COUNT> framesByOp;        //the same per operation
+        size_t next = 0;                                            //next of frames (not attached)
+        array<size_t, TLE7230::OP_COUNT> nextByOp{};                //next of framesByOp[op] (attached)
+        size_t cursor = 0;                                          //GPIO records before this are taken in
+        map<int, int> levels;                                       //gpio -> level as of cursor
+        map<int, pair<int, EdgeCallback>> callbacks;
+        int nextCallback = 0;
+        mutex lock;
+        Stats stats;
+
+        //the next frame recorded for op (-1: the next frame at all). GPIO levels and edges recorded before it are taken
+        //in, the edges collected for delivery
+        const TLE7230Trace::Entry* __next(int op, vector<pair<EdgeCallback, pair<int, int>>>& edges)
+        {
+            const vector<size_t>& list = op < 0 ? frames : framesByOp[op];
+            size_t& position = op < 0 ? next : nextByOp[op];
+            if(position >= list.size()) return nullptr;
+            size_t index = list[position++];
+            for(; cursor < index; ++cursor)
+            {
+                const TLE7230Trace::TraceRecord& r = trace.entries[cursor].record;
+                if(r.kind == TLE7230Trace::XFER || r.kind == TLE7230Trace::GPIO_WRITE) continue; //the driver's own writes replay themselves
+                levels[r.channel] = r.level;
+                if(r.kind == TLE7230Trace::EDGE)
+                    for(auto& [id, c] : callbacks) if(c.first == r.channel) edges.emplace_back(c.second, make_pair(int(r.channel), int(r.level)));
+            }
+            cursor = max(cursor, index + 1);
+            return &trace.entries[index];
+        }
+};
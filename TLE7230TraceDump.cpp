@@ -0,0 +1,119 @@
+/*****TLE7230TraceDump: prints, summarises and compares SPI traces written by TLE7230Recorder (TLE7230Trace.h) ********
+Runs anywhere (no pigpio needed).
+
+*****TO BUILD:
+g++ -DTLE7230_NO_PIGPIO TLE7230TraceDump.cpp -o TLE7230TraceDump -std=c++20
+
+*****TO RUN:
+./TLE7230TraceDump trace            every record: time, operation, chip-select channel, tx and rx bytes, the commands sent
+./TLE7230TraceDump trace -s         frames and bytes per driver operation
+./TLE7230TraceDump before -c after  frames per operation of two traces side by side, e.g. before and after a driver change
+
+Commands are shown per 16-bit word of the frame as sent (device N of a chain first): Wa=dd write, Ra read, X reset,
+D diagnosis only
+*/
+
+#include "TLE7230Trace.h"
+
+static string commands(const char* tx, int length)
+{
+    string out;
+    char word[16];
+    for(int i = 0; i + 1 < length; i += 2)
+    {
+        unsigned char cmd = tx[i], data = tx[i+1];
+        int addr = cmd & 0b00111111;
+        switch(cmd >> 6)
+        {
+            case 0b00: snprintf(word, sizeof word, "D"); break;
+            case 0b01: snprintf(word, sizeof word, "R%d", addr); break;
+            case 0b10: snprintf(word, sizeof word, "X"); break;
+            default:   snprintf(word, sizeof word, "W%d=%02x", addr, data);
+        }
+        out += (i ? " " : "") + string(word);
+    }
+    return out;
+}
+
+static string hex(const char* bytes, int length)
+{
+    string out;
+    char b[4];
+    for(int i = 0; i < length; ++i)
+    {
+        snprintf(b, sizeof b, "%02x", (unsigned char)bytes[i]);
+        out += b;
+    }
+    return out;
+}
+
+static const char* opName(uint8_t op) {return op < TLE7230::OP_COUNT ? TLE7230::OPERATION_NAMES[op] : "?";}
+
+static void dump(const TLE7230Trace::Trace& t)
+{
+    for(const TLE7230Trace::Entry& e : t.entries)
+    {
+        const TLE7230Trace::TraceRecord& r = e.record;
+        double ms = r.time / 1e6;
+        if(r.kind == TLE7230Trace::XFER)
+            printf("%12.3f  %-16s ch%d  %s -> %s  %s%s\n", ms, opName(r.op), r.channel, hex(t.tx(e), r.length).c_str(),
+                   hex(t.rx(e), r.length).c_str(), commands(t.tx(e), r.length).c_str(), r.result < 0 ? "  FAILED" : "");
+        else
+            printf("%12.3f  %-16s gpio%d = %d\n", ms, r.kind < 4 ? TLE7230Trace::KIND_NAMES[r.kind] : "?", r.channel, r.level);
+    }
+}
+
+//frames and bytes per operation
+static array<pair<unsigned long long, unsigned long long>, TLE7230::OP_COUNT + 1> count(const TLE7230Trace::Trace& t)
+{
+    array<pair<unsigned long long, unsigned long long>, TLE7230::OP_COUNT + 1> c{};
+    for(const TLE7230Trace::Entry& e : t.entries)
+        if(e.record.kind == TLE7230Trace::XFER)
+        {
+            auto& n = c[min<int>(e.record.op, TLE7230::OP_COUNT)];
+            ++n.first;
+            n.second += e.record.length;
+        }
+    return c;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printf("usage: %s trace [-s | -c other]\n", argv[0]);
+        return 1;
+    }
+    try
+    {
+        TLE7230Trace::Trace t = TLE7230Trace::readTrace(argv[1]);
+        if(argc > 2 && !strcmp(argv[2], "-s"))
+        {
+            auto c = count(t);
+            printf("%-16s %10s %10s\n", "operation", "frames", "bytes");
+            for(int op = 0; op <= TLE7230::OP_COUNT; ++op)
+                if(c[op].first) printf("%-16s %10llu %10llu\n", opName(op), c[op].first, c[op].second);
+        }
+        else if(argc > 3 && !strcmp(argv[2], "-c"))
+        {
+            auto a = count(t), b = count(TLE7230Trace::readTrace(argv[3]));
+            unsigned long long totalA = 0, totalB = 0;
+            printf("%-16s %10s %10s %10s\n", "operation", "before", "after", "change");
+            for(int op = 0; op <= TLE7230::OP_COUNT; ++op)
+            {
+                totalA += a[op].first;
+                totalB += b[op].first;
+                if(a[op].first || b[op].first)
+                    printf("%-16s %10llu %10llu %+10lld\n", opName(op), a[op].first, b[op].first, (long long)(b[op].first - a[op].first));
+            }
+            printf("%-16s %10llu %10llu %+10lld\n", "total", totalA, totalB, (long long)(totalB - totalA));
+        }
+        else dump(t);
+    }
+    catch(const exception& e)
+    {
+        printf("%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
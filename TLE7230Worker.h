@@ -0,0 +1,206 @@
+/*****TLE7230Worker: thread-safe front-end for a TLE7230 ***********************************************************
+Any number of threads queue relay/register commands; one worker thread owns the bus and runs whatever has piled up as
+a single TLE7230::Batch, so commands for different devices share frames and contention turns into bigger batches
+instead of a queue of lock waits.
+
+    TLE7230 relays(true, 4194304, 0x42, 8);
+    TLE7230Worker worker(relays);
+    future<TLE7230::BatchResult> r = worker.turnRelayOn(3, 5);   //from any thread
+    worker.readRegister(1, TLE7230::CTL, [](const TLE7230::BatchResult& r){ ... });   //or with a callback
+
+Ordering: commands from one thread for one device run in the order they were queued (a batch is cut before a write or
+reset that follows a read of the same device, see TLE7230::Batch::mustFollow()). Callbacks and futures complete on
+the worker thread.
+
+One worker can also own several drivers that share a bus (see TLE7230Manager): commands then name a board with submit(),
+and each pass runs one batch per board, one board after the other.
+*/
+
+#pragma once
+
+#include "TLE7230.h"
+#include <future>
+
+class TLE7230Worker
+{
+    public:
+        using Callback = function<void(const TLE7230::BatchResult&)>;
+
+    private:
+        struct Node
+        {
+            TLE7230::Batch::Op op;
+            size_t board = 0;
+            promise<TLE7230::BatchResult> result; //used when there is no callback
+            Callback done;
+            bool stop = false;
+            Node* next = nullptr;
+        };
+
+        vector<TLE7230*> drivers;
+        atomic<Node*> head{nullptr}; //lock-free multi-producer stack, the worker takes all of it at once
+        thread worker;
+        size_t maxBatch;
+        atomic<unsigned long long> batches{0};
+        atomic<unsigned long long> commands{0};
+
+        void __push(Node* n)
+        {
+            Node* old = head.load(memory_order_relaxed);
+            do n->next = old; while(!head.compare_exchange_weak(old, n, memory_order_release, memory_order_relaxed));
+            if(!old) head.notify_one(); //worker may be asleep on an empty queue
+        }
+
+        void __finish(size_t board, vector<Node*>& run, const TLE7230::Batch& batch)
+        {
+            vector<TLE7230::BatchResult> results;
+            exception_ptr error;
+            try {results = drivers[board]->execute(batch);}
+            catch(...) {error = current_exception();}
+            ++batches;
+            commands += run.size();
+            for(size_t i = 0; i < run.size(); ++i)
+            {
+                Node* n = run[i];
+                TLE7230::BatchResult failed;
+                failed.status = -1;
+                if(n->done)
+                {
+                    //a throwing callback mustn't end the worker thread (std::terminate) or strand the rest of the run
+                    try {n->done(error ? failed : results[i]);}
+                    catch(...) {}
+                }
+                else if(error) n->result.set_exception(error);
+                else n->result.set_value(results[i]);
+                delete n;
+            }
+            run.clear();
+        }
+
+        void __loop()
+        {
+            vector<Node*> pending;
+            size_t boards = drivers.size();
+            vector<vector<Node*>> runs(boards);
+            vector<TLE7230::Batch> boardBatches(boards);
+            bool stopping = false;
+            while(!stopping)
+            {
+                head.wait(nullptr, memory_order_acquire);
+                Node* list = head.exchange(nullptr, memory_order_acquire);
+                pending.clear();
+                for(; list; list = list->next) pending.push_back(list);
+                reverse(pending.begin(), pending.end()); //stack -> queue order
+
+                for(Node* n : pending)
+                {
+                    if(n->stop) {stopping = true; delete n; continue;}
+                    const TLE7230::Batch::Op& op = n->op;
+                    TLE7230::Batch& batch = boardBatches[n->board];
+                    if(batch.mustFollow(op) || batch.size() >= maxBatch)
+                    {
+                        __finish(n->board, runs[n->board], batch);
+                        batch.clear();
+                    }
+                    batch.add(op);
+                    runs[n->board].push_back(n);
+                }
+                for(size_t b = 0; b < boards; ++b)
+                {
+                    if(!runs[b].empty()) __finish(b, runs[b], boardBatches[b]);
+                    boardBatches[b].clear();
+                }
+            }
+        }
+
+        future<TLE7230::BatchResult> __submit(TLE7230::Batch::Kind kind, int device, char addr, char data, Callback done)
+        {
+            return submit(0, kind, device, addr, data, move(done));
+        }
+
+        static char __relayBit(int relay)
+        {
+            if(relay < 1 || relay > 8) throw runtime_error("invalid relay; TLE7230Worker");
+            return 1 << (relay-1);
+        }
+
+    public:
+        // @param driver the worker is the only thing that should call it from now on (TLE7230's own poller/fault thread are fine)
+        // @param maxBatch most commands merged into one execute(), bounds the latency of the first command in a burst
+        TLE7230Worker(TLE7230& driver, size_t maxBatch = 64) : TLE7230Worker(vector<TLE7230*>{&driver}, maxBatch) {}
+
+        // One worker for several drivers (boards), e.g. all the boards on one SPI bus. Board b is drivers[b]
+        // @throws runtime_error if drivers is empty
+        TLE7230Worker(vector<TLE7230*> drivers, size_t maxBatch = 64) : drivers(move(drivers)), maxBatch(maxBatch)
+        {
+            if(this->drivers.empty()) throw runtime_error("no drivers; TLE7230Worker()");
+            worker = thread(&TLE7230Worker::__loop, this);
+        }
+
+        // runs everything already queued, then stops the worker
+        ~TLE7230Worker()
+        {
+            Node* n = new Node();
+            n->stop = true;
+            __push(n);
+            worker.join();
+        }
+
+        // Each command returns a future, or with a callback an invalid future and the callback runs on the worker thread
+        // (anything it throws is dropped)
+        // @throws runtime_error on an invalid device/address/relay, in the calling thread
+        future<TLE7230::BatchResult> writeRegister(int device, char addr, char data, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::WRITE, device, addr, data, move(done));
+        }
+        future<TLE7230::BatchResult> turnRelayOn(int device, int relay, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, __relayBit(relay), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelayOff(int device, int relay, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, __relayBit(relay), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelaysOn(int device, bitset<8> relays, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::RELAYS_ON, device, TLE7230::CTL, relays.to_ulong(), move(done));
+        }
+        future<TLE7230::BatchResult> turnRelaysOff(int device, bitset<8> relays, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::RELAYS_OFF, device, TLE7230::CTL, relays.to_ulong(), move(done));
+        }
+        future<TLE7230::BatchResult> readRegister(int device, char addr, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::READ, device, addr, 0, move(done));
+        }
+        future<TLE7230::BatchResult> resetRegisters(int device, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::RESET, device, 0, 0, move(done));
+        }
+        future<TLE7230::BatchResult> updateDiagStatus(int device, Callback done = nullptr)
+        {
+            return __submit(TLE7230::Batch::DIAGNOSIS, device, 0, 0, move(done));
+        }
+
+        // Any command for any board; the named methods above are this for board 0
+        // @param addr register (WRITE/READ), CTL for RELAYS_ON/RELAYS_OFF @param data WRITE: data, RELAYS_x: relay mask
+        // @throws runtime_error on an invalid board/device/address, in the calling thread
+        future<TLE7230::BatchResult> submit(size_t board, TLE7230::Batch::Kind kind, int device, char addr, char data, Callback done = nullptr)
+        {
+            if(board >= drivers.size()) throw runtime_error("invalid board; TLE7230Worker");
+            if(device < 1 || device > drivers[board]->getDeviceCount()) throw runtime_error("invalid device; TLE7230Worker");
+            if((kind == TLE7230::Batch::WRITE || kind == TLE7230::Batch::READ) && (addr < 1 || addr > 8))
+                throw runtime_error("invalid address; TLE7230Worker");
+            Node* n = new Node();
+            n->op = TLE7230::Batch::Op{kind, device, addr, data};
+            n->board = board;
+            n->done = move(done);
+            future<TLE7230::BatchResult> f;
+            if(!n->done) f = n->result.get_future();
+            __push(n);
+            return f;
+        }
+
+        // @return (batches executed, commands executed); commands/batches is how much merging contention bought
+        pair<unsigned long long, unsigned long long> getStats() {return pair<unsigned long long, unsigned long long>(batches, commands);}
+};